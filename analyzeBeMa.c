@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bema.h"
+
+/* Offline analyzer for the heap snapshots written by Mem_Snapshot: for each
+   snapshot it prints a summary (block counts, free bytes, largest hole,
+   fragmentation and bytes wasted in block headers), a histogram of the free
+   block sizes and a map of the region, then the trend of the largest hole
+   and of the free bytes across all the snapshots given on the command line.
+
+   Usage: analyzeBeMa <snapshot>...  */
+
+/* Number of cells of the fragmentation map and cells per line.  */
+#define MAP_CELLS		1024
+#define MAP_WIDTH		64
+
+/* Power of two buckets of the free size histogram and width of its bars.  */
+#define HISTO_BUCKETS		48
+#define HISTO_WIDTH		50
+
+typedef struct snapshot
+{
+    const char *name;
+    bema_snapshot_header header;
+    bema_snapshot_block *blocks;
+    unsigned long long allocated, pending, free_bytes, largest;
+    unsigned long long nb_allocated, nb_pending, nb_free;
+} snapshot;
+
+#define BLOCK_SIZE(b)		((b)->size_state >> 2)
+#define BLOCK_STATE(b)		((unsigned int) ((b)->size_state & 3))
+
+/* Read a snapshot file, return -1 if it is not a valid snapshot.  */
+static int
+read_snapshot(const char *name, snapshot *s)
+{
+    FILE *f = fopen(name, "rb");
+    if (f == NULL)
+    {
+        perror(name);
+        return -1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    s->name = name;
+    if (fread(&s->header, sizeof(s->header), 1, f) != 1
+        || s->header.magic != BEMA_SNAPSHOT_MAGIC)
+    {
+        fprintf(stderr, "%s: not a BeMa snapshot\n", name);
+        fclose(f);
+        return -1;
+    }
+    if (s->header.version != BEMA_SNAPSHOT_VERSION)
+    {
+        fprintf(stderr, "%s: unsupported snapshot version %u\n", name,
+                s->header.version);
+        fclose(f);
+        return -1;
+    }
+
+    s->blocks = malloc(s->header.nb_blocks * sizeof(bema_snapshot_block) + 1);
+    if (s->blocks == NULL
+        || fread(s->blocks, sizeof(bema_snapshot_block), s->header.nb_blocks, f)
+           != s->header.nb_blocks)
+    {
+        fprintf(stderr, "%s: truncated snapshot\n", name);
+        free(s->blocks);
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+
+    for (unsigned long long i = 0; i < s->header.nb_blocks; i++)
+    {
+        bema_snapshot_block *b = &s->blocks[i];
+        unsigned long long size = BLOCK_SIZE(b);
+        switch (BLOCK_STATE(b))
+        {
+        case BEMA_SNAPSHOT_EMPTY:
+            s->nb_free++;
+            s->free_bytes += size;
+            if (size > s->largest)
+                s->largest = size;
+            break;
+        case BEMA_SNAPSHOT_PENDING:
+            s->nb_pending++;
+            s->pending += size;
+            break;
+        default:
+            s->nb_allocated++;
+            s->allocated += size;
+            break;
+        }
+    }
+    return 0;
+}
+
+static double
+fragmentation(const snapshot *s)
+{
+    if (s->free_bytes == 0)
+        return 0.0;
+    return 1.0 - (double) s->largest / s->free_bytes;
+}
+
+static void
+print_summary(const snapshot *s)
+{
+    unsigned long long headers = s->header.nb_blocks * s->header.head_size;
+
+    printf("=========== %s ===========\n", s->name);
+    printf("region            %llu bytes (%s mode)\n", s->header.region,
+           s->header.head_size == 0 ? "table" : "inline header");
+    printf("blocks            %llu (%llu allocated, %llu pending, %llu free)\n",
+           s->header.nb_blocks, s->nb_allocated, s->nb_pending, s->nb_free);
+    printf("allocated bytes   %llu\n", s->allocated);
+    printf("pending bytes     %llu\n", s->pending);
+    printf("free bytes        %llu\n", s->free_bytes);
+    printf("largest hole      %llu\n", s->largest);
+    printf("fragmentation     %.2f%%\n", 100.0 * fragmentation(s));
+    printf("header bytes      %llu (%.2f%% of the region)\n", headers,
+           s->header.region ? 100.0 * headers / s->header.region : 0.0);
+}
+
+/* Histogram of the free block sizes, one bucket per power of two.  */
+static void
+print_histogram(const snapshot *s)
+{
+    unsigned long long count[HISTO_BUCKETS] = { 0 };
+    unsigned long long max = 0;
+    int last = -1;
+
+    for (unsigned long long i = 0; i < s->header.nb_blocks; i++)
+    {
+        bema_snapshot_block *b = &s->blocks[i];
+        if (BLOCK_STATE(b) != BEMA_SNAPSHOT_EMPTY)
+            continue;
+        unsigned long long size = BLOCK_SIZE(b);
+        int k = size == 0 ? 0 : 64 - __builtin_clzll(size);
+        if (k >= HISTO_BUCKETS)
+            k = HISTO_BUCKETS - 1;
+        count[k]++;
+        if (count[k] > max)
+            max = count[k];
+        if (k > last)
+            last = k;
+    }
+
+    printf("free sizes:\n");
+    for (int k = 0; k <= last; k++)
+    {
+        int bar = (int) (count[k] * HISTO_WIDTH / max);
+        if (count[k] != 0 && bar == 0)
+            bar = 1;
+        printf("  < %12llu %10llu |%.*s\n", 1ULL << k, count[k], bar,
+               "##################################################");
+    }
+}
+
+/* Map of the region: each cell shows whether the bytes it covers are
+   allocated ('#'), free ('.') or both ('+').  Pending blocks count as
+   allocated, headers as the block they belong to.  */
+static void
+print_map(const snapshot *s)
+{
+    static unsigned long long used[MAP_CELLS], unused[MAP_CELLS];
+    unsigned long long region = s->header.region;
+    unsigned long long cell = (region + MAP_CELLS - 1) / MAP_CELLS;
+
+    if (cell == 0)
+        return;
+    memset(used, 0, sizeof(used));
+    memset(unused, 0, sizeof(unused));
+
+    for (unsigned long long i = 0; i < s->header.nb_blocks; i++)
+    {
+        bema_snapshot_block *b = &s->blocks[i];
+        unsigned long long start = b->offset;
+        unsigned long long end = start + s->header.head_size + BLOCK_SIZE(b);
+        unsigned long long *acc = BLOCK_STATE(b) == BEMA_SNAPSHOT_EMPTY ? unused : used;
+
+        if (end > region)
+            end = region;
+        while (start < end)
+        {
+            unsigned long long c = start / cell;
+            unsigned long long stop = (c + 1) * cell < end ? (c + 1) * cell : end;
+            acc[c] += stop - start;
+            start = stop;
+        }
+    }
+
+    printf("map (%llu bytes per cell):\n", cell);
+    for (int c = 0; c < MAP_CELLS && c * cell < region; c++)
+    {
+        if (c % MAP_WIDTH == 0)
+            printf("  ");
+        putchar(used[c] == 0 ? (unused[c] == 0 ? ' ' : '.')
+                : unused[c] == 0 ? '#' : '+');
+        if (c % MAP_WIDTH == MAP_WIDTH - 1)
+            putchar('\n');
+    }
+    printf("\n");
+}
+
+static void
+usage(const char *name)
+{
+    fprintf(stderr, "%s: <snapshot>...\n", name);
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2)
+        usage(argv[0]);
+
+    snapshot *snapshots = calloc(argc - 1, sizeof(snapshot));
+    int nb = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (read_snapshot(argv[i], &snapshots[nb]) != 0)
+            continue;
+        print_summary(&snapshots[nb]);
+        print_histogram(&snapshots[nb]);
+        print_map(&snapshots[nb]);
+        nb++;
+    }
+
+    if (nb > 1)
+    {
+        printf("=========== trend ===========\n");
+        printf("  %-24s %14s %14s %14s %8s\n", "snapshot", "seconds",
+               "free bytes", "largest hole", "frag");
+        for (int i = 0; i < nb; i++)
+        {
+            snapshot *s = &snapshots[i];
+            printf("  %-24s %14.3f %14llu %14llu %7.2f%%\n", s->name,
+                   (s->header.time - snapshots[0].header.time) / 1e9,
+                   s->free_bytes, s->largest, 100.0 * fragmentation(s));
+        }
+    }
+
+    for (int i = 0; i < nb; i++)
+        free(snapshots[i].blocks);
+    free(snapshots);
+    return nb == argc - 1 ? 0 : 1;
+}
@@ -1,4 +1,153 @@
-void *Mem_Alloc(int size); 
+#ifndef BEMA_H
+#define BEMA_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void *Mem_Alloc(size_t size); 
 
 int Mem_Free(void *ptr);
 
+/* Heap persistant : projette le fichier path (NULL = mémoire anonyme).
+   Retourne 1 si une région existante a été reprise, 0 si une nouvelle
+   région a été créée, -1 en cas d'erreur, de région incohérente ou si un
+   tas est déjà initialisé. */
+int Mem_Init(size_t size, const char *path);
+
+/* Force l'écriture de la région sur son fichier (msync). */
+int Mem_Sync(void);
+
+/* Vérifie la chaine des blocs et reconstruit les compteurs du manager. */
+int Mem_Check(void);
+
+/* Pointeur racine conservé dans le superbloc entre deux exécutions
+   (effacé si son bloc est libéré). */
+int Mem_SetRoot(void *ptr);
+
+void *Mem_GetRoot(void);
+
+/* Blocs déplaçables : le compacteur peut déplacer un bloc non verrouillé,
+   Mem_Deref n'est donc valable que jusqu'au prochain Mem_Compact. */
+unsigned int Mem_AllocHandle(size_t size);
+
+void *Mem_Lock(unsigned int h);
+
+int Mem_Unlock(unsigned int h);
+
+void *Mem_Deref(unsigned int h);
+
+int Mem_FreeHandle(unsigned int h);
+
+/* Compactage incrémental borné à budget octets déplacés/parcourus (un
+   bloc plus grand, comme la table des handles, est déplacé seul dans sa
+   tranche). Retourne 1 quand une passe complète est terminée. */
+int Mem_Compact(size_t budget);
+
+void Mem_Stats(size_t *nb_empty, size_t *max_empty, size_t *footprint);
+
+void *Mem_Calloc(size_t nmemb, size_t size);
+
+/* Maintenance différée : en mode 1 (Mem_Maintain explicite) ou 2 (thread
+   de fond), Mem_Free met seulement le bloc en attente ; la fusion, la
+   remise à 0 et la mise à jour des compteurs sont faites par lots.
+   Le mode 0 (par défaut) libère de façon synchrone. */
+int Mem_SetMaintenance(int mode);
+
+/* Traite les blocs en attente, retourne leur nombre. */
+int Mem_Maintain(void);
+
+/* Tas sans entete en ligne : les métadonnées des blocs sont dans une table
+   séparée (à appeler à la place de Mem_Init ; handles, compactage,
+   maintenance et persistance ne sont pas disponibles dans ce mode). */
+int Mem_InitTable(size_t size);
+
+/* Taille réelle du bloc contenant ptr (-1 si ptr n'est pas alloué). */
+ssize_t Mem_GetSize(void *ptr);
+
+/* Classes de tailles : chaque demande est arrondie à la plus petite classe
+   qui la contient. Mem_TuneClasses recalcule nb classes minimisant la perte
+   sur l'histogramme des tailles demandées ; sur un histogramme plein, ce
+   calcul prend des dizaines de ms, verrou du tas tenu. Mem_SetTuning le
+   demande toutes les period allocations (0 = jamais), sans le faire dans
+   Mem_Alloc : il est fait au prochain Mem_Maintain ou par le thread de
+   maintenance (mode 2), verrou relaché pendant le calcul. Mem_ExportClasses
+   écrit la table sous forme d'en-tete C à compiler avec
+   make CLASSES=<fichier>. */
+int Mem_SetClasses(const size_t *classes, unsigned int nb);
+
+int Mem_TuneClasses(unsigned int nb);
+
+int Mem_SetTuning(size_t period, unsigned int nb);
+
+int Mem_ExportClasses(int fd);
+
+/* Bloc dont l'adresse est un multiple de align (puissance de 2), libéré par
+   Mem_Free. Une taille de 0 donne un bloc d'un octet. */
+void *Mem_AllocAligned(size_t size, size_t align);
+
+/* Comme Mem_Alloc, mais place le bloc au plus près du bloc alloué contenant
+   hint (voisins libres, même page) pour garder ensemble les structures
+   parcourues parent -> enfant. Sans voisin assez grand, ou si hint n'est pas
+   un bloc du tas, le placement est celui de Mem_Alloc. */
+void *Mem_AllocNear(size_t size, void *hint);
+
+/* Copie cohérente de la liste des blocs écrite en binaire sur fd : un
+   bema_snapshot_header puis nb_blocks bema_snapshot_block. Le verrou n'est
+   tenu que pendant la copie en mémoire, pas pendant l'écriture. Retourne -1
+   si le tas n'est pas initialisé, si la copie ne peut pas être allouée ou si
+   l'écriture échoue, 0 sinon. */
+#define BEMA_SNAPSHOT_MAGIC 0x536D6542
+#define BEMA_SNAPSHOT_VERSION 1
+
+/* Etats d'un bloc dans un snapshot */
+#define BEMA_SNAPSHOT_EMPTY 0
+#define BEMA_SNAPSHOT_ALLOCATED 1
+#define BEMA_SNAPSHOT_PENDING 2
+
+typedef struct bema_snapshot_header {
+    unsigned int magic;
+    unsigned int version;
+    /* Taille de l'entete en ligne de chaque bloc (0 en mode table) */
+    unsigned int head_size;
+    unsigned int pad;
+    unsigned long long time;
+    unsigned long long region;
+    unsigned long long nb_blocks;
+} bema_snapshot_header;
+
+typedef struct bema_snapshot_block {
+    unsigned long long offset;
+    /* Taille des données << 2 | état */
+    unsigned long long size_state;
+} bema_snapshot_block;
+
+int Mem_Snapshot(int fd);
+
+/* Libère n blocs en une seule prise du verrou. Retourne -1 si l'un des
+   pointeurs n'était pas un bloc alloué (les autres sont quand même libérés). */
+int Mem_FreeBulk(void **ptrs, size_t n);
+
+/* Récupération par époques pour les structures sans verrou : les lectures
+   se font entre Mem_EpochEnter et Mem_EpochExit (sections imbricables), et
+   un bloc retiré de la structure est confié à Mem_FreeDeferred au lieu de
+   Mem_Free. Il n'est libéré, par lots via Mem_FreeBulk, qu'une fois que tous
+   les threads entrés avant son retrait sont sortis de leur section. */
+int Mem_EpochEnter(void);
+
+int Mem_EpochExit(void);
+
+int Mem_FreeDeferred(void *ptr);
+
+/* Libère tout de suite ce qui peut l'être parmi les blocs retirés par le
+   thread courant, retourne le nombre de blocs encore en attente. */
+size_t Mem_EpochReclaim(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
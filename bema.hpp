@@ -0,0 +1,101 @@
+#ifndef BEMA_HPP
+#define BEMA_HPP
+
+/* Adaptateurs C++ pour libBeMa : std::pmr::memory_resource, ressource
+   monotone alimentée par le tas et allocateur STL sans état. */
+
+#include <cstddef>
+#include <limits>
+#include <memory_resource>
+#include <new>
+
+#include "bema.h"
+
+namespace bema {
+
+/* Ressource polymorphe sur le tas : l'alignement est demandé à
+   Mem_AllocAligned, Mem_Free retrouve le bloc depuis n'importe quel
+   pointeur intérieur. */
+class BeMaResource : public std::pmr::memory_resource {
+protected:
+    void *do_allocate(std::size_t bytes, std::size_t alignment) override
+    {
+        void *ptr = Mem_AllocAligned(bytes, alignment);
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return ptr;
+    }
+
+    void do_deallocate(void *ptr, std::size_t, std::size_t) override
+    {
+        Mem_Free(ptr);
+    }
+
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+    {
+        /* Un seul tas par processus : toutes les instances sont équivalentes */
+        return dynamic_cast<const BeMaResource *>(&other) != nullptr;
+    }
+};
+
+/* Instance partagée, à la manière de std::pmr::new_delete_resource(). */
+inline std::pmr::memory_resource *bema_resource() noexcept
+{
+    static BeMaResource resource;
+    return &resource;
+}
+
+/* Ressource monotone dont les tampons sont pris sur le tas : les
+   libérations individuelles ne coûtent rien, tout est rendu à la
+   destruction ou par release(). */
+class BeMaMonotonicResource : public std::pmr::monotonic_buffer_resource {
+public:
+    explicit BeMaMonotonicResource(std::size_t initial_size = 4096)
+        : std::pmr::monotonic_buffer_resource(initial_size, bema_resource())
+    {
+    }
+};
+
+/* Allocateur STL sans état, utilisable avec std::vector,
+   std::unordered_map, ... */
+template <class T>
+class BeMaAllocator {
+public:
+    typedef T value_type;
+
+    BeMaAllocator() noexcept {}
+
+    template <class U>
+    BeMaAllocator(const BeMaAllocator<U> &) noexcept {}
+
+    T *allocate(std::size_t n)
+    {
+        if (n > std::numeric_limits<std::size_t>::max() / sizeof(T))
+            throw std::bad_array_new_length();
+        void *ptr = Mem_AllocAligned(n * sizeof(T), alignof(T));
+        if (ptr == nullptr)
+            throw std::bad_alloc();
+        return static_cast<T *>(ptr);
+    }
+
+    void deallocate(T *ptr, std::size_t) noexcept
+    {
+        Mem_Free(ptr);
+    }
+};
+
+template <class T, class U>
+bool operator==(const BeMaAllocator<T> &, const BeMaAllocator<U> &) noexcept
+{
+    return true;
+}
+
+template <class T, class U>
+bool operator!=(const BeMaAllocator<T> &, const BeMaAllocator<U> &) noexcept
+{
+    return false;
+}
+
+}
+
+#endif
@@ -18,77 +18,694 @@
 #include <math.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <limits.h>
+#include <stdint.h>
+
+#include "bema.h"
 
 #define NB_THREAD 2
 
+// Signature d'une entete valide
+#define MEMORY_SERIAL 123456
+
+// Superbloc : identifiant "BeMa" et version du format de la région
+#define MEMORY_MAGIC 0x42654D61
+#define MEMORY_VERSION 5
+
+// Modes de maintenance : libération synchrone, différée avec Mem_Maintain, ou par un thread
+#define MEMORY_MAINTAIN_OFF 0
+#define MEMORY_MAINTAIN_MANUAL 1
+#define MEMORY_MAINTAIN_THREAD 2
+
+// Taille de lot qui réveille le thread de maintenance et sa période (ms)
+#define MEMORY_PENDING_BATCH 256
+#define MEMORY_MAINTAIN_PERIOD 10
+
+// Histogramme des tailles demandées et nombre maximal de classes de tailles
+#define MEMORY_HISTO_STEP 8
+#define MEMORY_HISTO_MAX 4096
+#define MEMORY_HISTO_BUCKETS (MEMORY_HISTO_MAX/MEMORY_HISTO_STEP)
+#define MEMORY_MAX_CLASSES 64
+
+// Voisinage exploré par Mem_AllocNear autour du bloc indice : distance
+// maximale en octets et nombre de blocs examinés de chaque côté
+#define MEMORY_NEAR_WINDOW 4096
+#define MEMORY_NEAR_SPAN 16
+
+// Table de classes fixée à la compilation (make CLASSES=<fichier exporté>)
+#ifdef BEMA_CLASSES_FILE
+#include BEMA_CLASSES_FILE
+#endif
+
 typedef enum TYPE_MEMORY_HEAD {
     EMPTY,
     ALLOCATED,
+    PENDING,
 } TYPE_MEMORY_HEAD;
 
 typedef struct memory_head {
+    size_t size;
+    // Les liens sont des offsets depuis le manager (0 = aucun) pour que
+    // la région reste valide quelle que soit son adresse de projection
+    size_t next;
+    size_t prev;
     TYPE_MEMORY_HEAD type;
-    unsigned int size;
     unsigned int serial;
-    struct memory_head* next;
-    struct memory_head* prev;
+    // Numéro de handle si le bloc est déplaçable (0 = bloc fixe)
+    unsigned int handle;
 } memory_head;
 
+// Entrée de la table des handles : offset de l'entete et compteur de verrous
+typedef struct memory_handle {
+    size_t block;
+    unsigned int lock;
+} memory_handle;
+
 typedef struct memory_manager {
-    unsigned int nb_empty;
-    unsigned int max_empty;
-    unsigned int size;
-    memory_head* first;
-    memory_head* last;
+    unsigned int magic;
+    unsigned int version;
+    size_t region;
+    size_t nb_empty;
+    size_t max_empty;
+    size_t size;
+    size_t first;
+    size_t last;
+    size_t root;
+    size_t handles;
+    size_t nb_handles;
+    size_t compact;
 } memory_manager;
 
 memory_manager* mm;
 unsigned int memory_manager_init = 0;
 pthread_mutex_t memory_manager_mutex;
 
-void Mem_Init (unsigned int size) {
+// Verrou global : les appels à l'API depuis plusieurs threads sont sérialisés
+pthread_mutex_t memory_manager_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Blocs libérés en attente de fusion (offsets), propres au processus
+int memory_maintain_mode = MEMORY_MAINTAIN_OFF;
+size_t* memory_pending = NULL;
+unsigned int memory_nb_pending = 0;
+unsigned int memory_max_pending = 0;
+pthread_t memory_maintain_thread;
+pthread_cond_t memory_maintain_cond = PTHREAD_COND_INITIALIZER;
+
+// Classes de tailles courantes (aucune : les tailles sont prises telles quelles)
+#ifdef BEMA_CLASSES
+size_t memory_classes[MEMORY_MAX_CLASSES] = BEMA_CLASSES;
+unsigned int memory_nb_classes = BEMA_NB_CLASSES;
+#else
+size_t memory_classes[MEMORY_MAX_CLASSES];
+unsigned int memory_nb_classes = 0;
+#endif
+uint64_t memory_histo_count[MEMORY_HISTO_BUCKETS];
+uint64_t memory_histo_sum[MEMORY_HISTO_BUCKETS];
+size_t memory_tune_period = 0;
+size_t memory_tune_count = 0;
+unsigned int memory_tune_classes = 0;
+// Réapprentissage périodique demandé, fait hors de Mem_Alloc
+int memory_tune_due = 0;
+
+// Conversion offset -> entete
+static inline memory_head* Mem_HeadAt (size_t off) {
+    return off == 0 ? NULL : (memory_head*) ((void*) mm + off);
+}
+
+// Conversion entete -> offset
+static inline size_t Mem_HeadOffset (memory_head* mh) {
+    return mh == NULL ? 0 : (size_t) ((void*) mh - (void*) mm);
+}
+
+// Table des handles, stockée dans la région
+static inline memory_handle* Mem_HandleTable () {
+    return (memory_handle*) ((void*) mm + mm->handles);
+}
+
+// Mise en attente d'un bloc libéré (-1 si la file ne peut pas grandir)
+static int Mem_PendingPush (memory_head* mh) {
+    
+    if (memory_nb_pending == memory_max_pending) {
+        unsigned int max = memory_max_pending == 0 ? MEMORY_PENDING_BATCH : memory_max_pending*2;
+        size_t* pending = (size_t*) realloc(memory_pending, max*sizeof(size_t));
+        if (pending == NULL) {
+            return -1;
+        }
+        memory_pending = pending;
+        memory_max_pending = max;
+    }
+    
+    mh->type = PENDING;
+    memory_pending[memory_nb_pending++] = Mem_HeadOffset(mh);
+    return 0;
+}
+
+#define NEXT(mh) Mem_HeadAt((mh)->next)
+#define PREV(mh) Mem_HeadAt((mh)->prev)
+
+static int Mem_MaintainLocked ();
+static int Mem_TuneClassesLocked (unsigned int nb);
+static void Mem_TuneDueLocked ();
+
+// Mode table : les métadonnées des blocs (offset, taille, état) sont rangées
+// hors de la région dans des tableaux contigus triés par offset ; les données
+// utilisateur n'ont plus d'entete et un débordement ne peut plus les atteindre
+// (contrepartie : découper ou fusionner un bloc décale la fin des tableaux,
+// un coût mesuré par le mode "table" de testBeMa)
+#define MEMORY_TABLE_GRAIN 16
+
+// Vecteur de tailles comparées d'un coup par la recherche
+typedef size_t memory_vec __attribute__ ((vector_size (4*sizeof(size_t))));
+
+typedef struct memory_table {
+    void* base;
+    size_t region;
+    size_t nb;
+    size_t max;
+    size_t* offset;
+    size_t* size;
+    unsigned char* state;
+} memory_table;
+
+memory_table mt;
+unsigned int memory_table_init = 0;
+
+static int Mem_InitTableLocked (size_t size) {
+    
+    size_t sizeOfRegion;
+    
+    // Un seul tas par processus
+    if (memory_manager_init != 0 || memory_table_init != 0) {
+        return -1;
+    }
+    if (__builtin_mul_overflow(size/getpagesize()+1, (size_t) getpagesize(), &sizeOfRegion)) {
+        return -1;
+    }
+    
+    // La région ne contient que des données
+    mt.base = mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED | MAP_NORESERVE, -1, 0);
+    
+    if (mt.base == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+    
+    // La table est une projection séparée, dimensionnée pour le plus grand nombre de blocs possible
+    mt.max = sizeOfRegion/MEMORY_TABLE_GRAIN;
+    void* table = mmap(NULL, mt.max*(2*sizeof(size_t)+1), PROT_READ | PROT_WRITE, MAP_ANON | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    
+    if (table == MAP_FAILED) {
+        perror("mmap");
+        munmap(mt.base, sizeOfRegion);
+        return -1;
+    }
+    
+    mt.region = sizeOfRegion;
+    mt.offset = (size_t*) table;
+    mt.size = mt.offset + mt.max;
+    mt.state = (unsigned char*) (mt.size + mt.max);
+    
+    // Un seul bloc libre couvre toute la région
+    mt.nb = 1;
+    mt.offset[0] = 0;
+    mt.size[0] = sizeOfRegion;
+    mt.state[0] = EMPTY;
+    
+    memory_table_init = 1;
+    
+    return 0;
+}
+
+// Premier bloc libre d'au moins size octets, mt.nb si aucun
+static size_t Mem_TableSearch (size_t size) {
+    
+    memory_vec want = { size, size, size, size };
+    size_t i = 0;
+    
+    // On compare quatre tailles à la fois, l'état n'est lu que pour les candidats
+    for (; i + 4 <= mt.nb; i += 4) {
+        
+        memory_vec v;
+        memcpy(&v, &mt.size[i], sizeof(v));
+        memory_vec hit = v >= want;
+        
+        if (hit[0] | hit[1] | hit[2] | hit[3]) {
+            for (size_t k=i; k<i+4; k++) {
+                if (mt.size[k] >= size && mt.state[k] == EMPTY) {
+                    return k;
+                }
+            }
+        }
+    }
+    
+    for (; i < mt.nb; i++) {
+        if (mt.size[i] >= size && mt.state[i] == EMPTY) {
+            return i;
+        }
+    }
+    
+    return mt.nb;
+}
+
+// Entrée du bloc alloué contenant ptr (n'importe quel pointeur du bloc), mt.nb si aucun
+static size_t Mem_TableFind (void* ptr) {
+    
+    if (ptr < mt.base || ptr >= mt.base + mt.region) {
+        return mt.nb;
+    }
+    
+    size_t off = ptr - mt.base;
+    size_t lo = 0;
+    size_t hi = mt.nb;
+    
+    // Recherche dichotomique du dernier bloc commençant avant ptr
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi)/2;
+        if (mt.offset[mid] <= off) {
+            lo = mid;
+        }
+        else {
+            hi = mid;
+        }
+    }
+    
+    return mt.state[lo] == ALLOCATED ? lo : mt.nb;
+}
+
+static void Mem_TableInsert (size_t i, size_t offset, size_t size) {
+    
+    memmove(&mt.offset[i+1], &mt.offset[i], (mt.nb-i)*sizeof(size_t));
+    memmove(&mt.size[i+1], &mt.size[i], (mt.nb-i)*sizeof(size_t));
+    memmove(&mt.state[i+1], &mt.state[i], mt.nb-i);
+    
+    mt.offset[i] = offset;
+    mt.size[i] = size;
+    mt.state[i] = EMPTY;
+    mt.nb++;
+}
+
+// Suppression des n entrées à partir de i
+static void Mem_TableRemove (size_t i, size_t n) {
+    
+    mt.nb -= n;
+    memmove(&mt.offset[i], &mt.offset[i+n], (mt.nb-i)*sizeof(size_t));
+    memmove(&mt.size[i], &mt.size[i+n], (mt.nb-i)*sizeof(size_t));
+    memmove(&mt.state[i], &mt.state[i+n], mt.nb-i);
+}
+
+// Placement de size octets (déjà arrondis au grain) au début du bloc libre i
+static void* Mem_TableAllocAt (size_t i, size_t size) {
+    
+    // Le reste du bloc devient un nouveau bloc libre juste après
+    if (mt.size[i] > size) {
+        Mem_TableInsert(i+1, mt.offset[i] + size, mt.size[i] - size);
+        mt.size[i] = size;
+    }
+    
+    mt.state[i] = ALLOCATED;
+    
+    // Les blocs libres sont toujours remplis de 0
+    return mt.base + mt.offset[i];
+}
+
+static void* Mem_TableAlloc (size_t size) {
+    
+    if (size > mt.region) {
+        return NULL;
+    }
+    
+    // Les tailles sont arrondies au grain, ce qui garde les données alignées
+    size = size == 0 ? MEMORY_TABLE_GRAIN : (size + MEMORY_TABLE_GRAIN - 1) & ~((size_t) MEMORY_TABLE_GRAIN - 1);
+    
+    size_t i = Mem_TableSearch(size);
+    
+    if (i == mt.nb) {
+        return NULL;
+    }
+    
+    return Mem_TableAllocAt(i, size);
+}
+
+// Allocation dans le bloc libre le plus proche du bloc contenant hint,
+// sinon premier bloc libre comme Mem_TableAlloc
+static void* Mem_TableAllocNear (size_t size, void* hint) {
+    
+    size_t h = Mem_TableFind(hint);
+    
+    if (h == mt.nb || size > mt.region) {
+        return Mem_TableAlloc(size);
+    }
+    
+    size = size == 0 ? MEMORY_TABLE_GRAIN : (size + MEMORY_TABLE_GRAIN - 1) & ~((size_t) MEMORY_TABLE_GRAIN - 1);
+    
+    size_t after = mt.nb;
+    size_t before = mt.nb;
+    size_t end = mt.offset[h] + mt.size[h];
+    
+    // Premier bloc libre assez grand après l'indice, puis avant
+    for (size_t i=h+1; i<mt.nb && i-h <= MEMORY_NEAR_SPAN && mt.offset[i] - end < MEMORY_NEAR_WINDOW; i++) {
+        if (mt.state[i] == EMPTY && mt.size[i] >= size) {
+            after = i;
+            break;
+        }
+    }
+    for (size_t i=h; i>0 && h-i < MEMORY_NEAR_SPAN && mt.offset[h] - (mt.offset[i-1] + mt.size[i-1]) < MEMORY_NEAR_WINDOW; i--) {
+        if (mt.state[i-1] == EMPTY && mt.size[i-1] >= size) {
+            before = i-1;
+            break;
+        }
+    }
+    
+    if (after == mt.nb && before == mt.nb) {
+        return Mem_TableAlloc(size);
+    }
+    
+    // On garde le plus proche des deux
+    if (before == mt.nb
+        || (after != mt.nb && mt.offset[after] - end <= mt.offset[h] - (mt.offset[before] + mt.size[before]))) {
+        return Mem_TableAllocAt(after, size);
+    }
+    
+    // Avant l'indice, on prend la fin du bloc libre pour être collé à lui
+    if (mt.size[before] > size) {
+        Mem_TableInsert(before+1, mt.offset[before] + mt.size[before] - size, size);
+        mt.size[before] -= size;
+        before++;
+    }
+    
+    mt.state[before] = ALLOCATED;
+    
+    return mt.base + mt.offset[before];
+}
+
+static int Mem_TableFree (void* ptr) {
+    
+    size_t i = Mem_TableFind(ptr);
+    
+    if (i == mt.nb) {
+        return -1;
+    }
+    
+    // On ré-initialise le bloc mémoire avec que des 0
+    memset(mt.base + mt.offset[i], 0, mt.size[i]);
+    mt.state[i] = EMPTY;
+    
+    // Fusion avec le suivant et le précédent : les entrées absorbées sont
+    // retirées en un seul décalage de la fin des tableaux
+    size_t first = i;
+    size_t last = i;
+    
+    if (i+1 < mt.nb && mt.state[i+1] == EMPTY) {
+        last = i+1;
+    }
+    if (i > 0 && mt.state[i-1] == EMPTY) {
+        first = i-1;
+    }
+    for (size_t k=first+1; k<=last; k++) {
+        mt.size[first] += mt.size[k];
+    }
+    if (last > first) {
+        Mem_TableRemove(first+1, last-first);
+    }
+    
+    return 0;
+}
+
+static int Mem_TableCheck () {
+    
+    size_t off = 0;
+    
+    // Les blocs doivent couvrir la région sans trou, sans deux blocs libres consécutifs
+    for (size_t i=0; i<mt.nb; i++) {
+        if (mt.offset[i] != off || mt.size[i] == 0 || mt.size[i] % MEMORY_TABLE_GRAIN != 0
+            || (mt.state[i] != EMPTY && mt.state[i] != ALLOCATED)
+            || (i > 0 && mt.state[i] == EMPTY && mt.state[i-1] == EMPTY)) {
+            return -1;
+        }
+        off += mt.size[i];
+    }
+    
+    return off == mt.region ? 0 : -1;
+}
+
+static void Mem_TableStats (size_t* nb_empty, size_t* max_empty, size_t* footprint) {
+    
+    for (size_t i=0; i<mt.nb; i++) {
+        if (mt.state[i] == EMPTY) {
+            (*nb_empty)++;
+            if (mt.size[i] > *max_empty) {
+                *max_empty = mt.size[i];
+            }
+        }
+        else {
+            *footprint = mt.offset[i] + mt.size[i];
+        }
+    }
+}
+
+static int Mem_CheckLocked () {
+    
+    if (memory_table_init != 0) {
+        return Mem_TableCheck();
+    }
+    
+    size_t nb_empty = 0;
+    size_t max_empty = 0;
+    size_t prev = 0;
+    
+    // La chaine commence juste après le manager
+    size_t off = sizeof(memory_manager);
+    
+    if (mm->first != off) {
+        return -1;
+    }
+    
+    // La table des handles est bornée par la région avant d'être lue
+    if (mm->handles == 0 ? mm->nb_handles != 0
+        : mm->handles > mm->region
+          || mm->nb_handles > (mm->region - mm->handles)/sizeof(memory_handle)) {
+        return -1;
+    }
+    
+    // Table des handles, curseur de compactage et racine doivent désigner des blocs de la chaine
+    int handles_found = mm->handles == 0;
+    int compact_found = mm->compact == 0;
+    int root_found = mm->root == 0;
+    
+    // Les blocs doivent se suivre sans trou jusqu'à la fin de la région
+    while (off != 0) {
+        
+        if (off > mm->region - sizeof(memory_head)) {
+            return -1;
+        }
+        
+        memory_head* mh = Mem_HeadAt(off);
+        
+        if (mh->serial != MEMORY_SERIAL
+            || (mh->type != EMPTY && mh->type != ALLOCATED && mh->type != PENDING)
+            || mh->prev != prev
+            || mh->size > mm->region - off - sizeof(memory_head)) {
+            return -1;
+        }
+        
+        size_t end = off + sizeof(memory_head) + mh->size;
+        
+        // Le suivant doit commencer exactement à la fin du bloc courant
+        if (mh->next != 0 && mh->next != end) {
+            return -1;
+        }
+        if (mh->next == 0 && (end != mm->region || mm->last != off)) {
+            return -1;
+        }
+        
+        // Un bloc déplaçable doit être référencé par son handle
+        if (mh->handle != 0
+            && (mh->handle > mm->nb_handles
+                || Mem_HandleTable()[mh->handle-1].block != off)) {
+            return -1;
+        }
+        
+        if (mh->type == EMPTY) {
+            nb_empty++;
+            if (mh->size > max_empty) {
+                max_empty = mh->size;
+            }
+        }
+        
+        if (off == mm->compact) {
+            compact_found = 1;
+        }
+        if (mh->type == ALLOCATED) {
+            if (off + sizeof(memory_head) == mm->handles
+                && mh->size >= mm->nb_handles*sizeof(memory_handle)) {
+                handles_found = 1;
+            }
+            if (mm->root >= off + sizeof(memory_head) && mm->root < end) {
+                root_found = 1;
+            }
+        }
+        
+        prev = off;
+        off = mh->next;
+    }
+    
+    if (!handles_found || !compact_found || !root_found) {
+        return -1;
+    }
+    
+    // Les compteurs sont reconstruits à partir de la chaine
+    mm->nb_empty = nb_empty;
+    mm->max_empty = max_empty;
+    
+    return 0;
+}
+
+static int Mem_InitLocked (size_t size, const char* path) {
+    
+    int fd = -1;
+    size_t sizeOfRegion;
+    struct stat st;
+    
+    // Un seul tas par processus
+    if (memory_manager_init != 0 || memory_table_init != 0) {
+        return -1;
+    }
+    
+    // Arrondi à la page supérieure, sans débordement
+    if (__builtin_mul_overflow(size/getpagesize()+1, (size_t) getpagesize(), &sizeOfRegion)) {
+        return -1;
+    }
     
-    int sizeOfRegion = (size/getpagesize()+1)*getpagesize();
+    // Si un fichier est fourni, la région est projetée depuis ce fichier
+    if (path != NULL) {
+        
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        
+        if (fd < 0) {
+            perror("open");
+            return -1;
+        }
+        if (fstat(fd, &st) < 0) {
+            perror("fstat");
+            close(fd);
+            return -1;
+        }
+        
+        // Un fichier non vide contient une région existante : on la reprend telle quelle
+        if (st.st_size > 0) {
+            sizeOfRegion = st.st_size;
+        }
+        else if (ftruncate(fd, sizeOfRegion) < 0) {
+            perror("ftruncate");
+            close(fd);
+            return -1;
+        }
+    }
     
-    printf("Mémoire réservée: %d \n", sizeOfRegion);
+    printf("Mémoire réservée: %zu \n", sizeOfRegion);
     
     // Allocation mémoire auprès du Systeme d'Exploitation
-    mm = (memory_manager*) mmap(NULL, sizeOfRegion, PROT_WRITE, MAP_ANON | MAP_SHARED, -1, 0);
+    // (sans réservation : seules les pages touchées sont consommées)
+    if (fd < 0) {
+        mm = (memory_manager*) mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_ANON | MAP_SHARED | MAP_NORESERVE, -1, 0);
+    }
+    else {
+        mm = (memory_manager*) mmap(NULL, sizeOfRegion, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        
+        // La projection reste valide après la fermeture du descripteur
+        close(fd);
+    }
     
     if (mm == MAP_FAILED) {
         perror("mmap");
-        exit(1);
+        mm = NULL;
+        return -1;
     }
     
-    // On initialise la mémoire avec que des 0
-    memset(mm, 0, sizeOfRegion);
-    
     // Taille de la page mémoire
     printf("Taille page mémoire: %d \n", getpagesize());
     printf("Position dans la mémoire : %p \n", mm);
     
+    // Reprise d'une région existante : on vérifie le superbloc et la chaine des blocs
+    if (path != NULL && st.st_size > 0) {
+        
+        if (mm->magic != MEMORY_MAGIC || mm->version != MEMORY_VERSION
+            || mm->region != sizeOfRegion || Mem_CheckLocked() < 0) {
+            fprintf(stderr, "Mem_Init: région %s incohérente\n", path);
+            munmap(mm, sizeOfRegion);
+            mm = NULL;
+            return -1;
+        }
+        
+        // Les verrous de l'exécution précédente ne sont plus valables
+        for (size_t i=0; i<mm->nb_handles; i++) {
+            Mem_HandleTable()[i].lock = 0;
+        }
+        
+        // Les blocs restés en attente sont libérés maintenant (Mem_MaintainLocked
+        // ne fait rien tant que le tas n'est pas marqué initialisé)
+        memory_manager_init = 1;
+        memory_nb_pending = 0;
+        for (memory_head* elt = Mem_HeadAt(mm->first); elt != NULL; elt = NEXT(elt)) {
+            if (elt->type == PENDING) {
+                elt->type = ALLOCATED;
+                Mem_PendingPush(elt);
+            }
+        }
+        Mem_MaintainLocked();
+        
+        return 1;
+    }
+    
+    // Une projection neuve est déjà remplie de 0 : on évite de toucher toute la région
+    
     // Initialisation du manager de la mémoire
+    mm->magic = MEMORY_MAGIC;
+    mm->version = MEMORY_VERSION;
+    mm->region = sizeOfRegion;
     mm->size = sizeOfRegion-sizeof(memory_manager)-sizeof(memory_head);
     mm->nb_empty = 1;
     mm->max_empty = mm->size;
-    mm->first = (memory_head*) ((void*) mm + sizeof(memory_manager));
+    mm->first = sizeof(memory_manager);
     mm->last = mm->first;
+    mm->root = 0;
+    mm->handles = 0;
+    mm->nb_handles = 0;
+    mm->compact = 0;
     
     // Initialisation de la première entete
-    mm->first->type = EMPTY;
-    mm->first->size = mm->size;
-    mm->first->next = NULL;
-    mm->first->prev = NULL;
-    mm->first->serial = 123456;
+    memory_head* first = Mem_HeadAt(mm->first);
+    first->type = EMPTY;
+    first->size = mm->size;
+    first->next = 0;
+    first->prev = 0;
+    first->handle = 0;
+    first->serial = MEMORY_SERIAL;
     
     // On signale que le manager a été initialisé !
     memory_manager_init = 1;
+    
+    return 0;
+}
+
+static int Mem_SyncLocked () {
+    
+    if (memory_manager_init == 0) {
+        return -1;
+    }
+    
+    // On force l'écriture de la région sur son support
+    if (msync(mm, mm->region, MS_SYNC) < 0) {
+        perror("msync");
+        return -1;
+    }
+    return 0;
 }
 
 typedef struct memory_search {
     unsigned int num;
     int* sync;
-    unsigned int size;
+    size_t size;
     memory_head** elt;
     pthread_t* threads;
 } memory_search;
@@ -104,24 +721,24 @@ void* Mem_ThreadSearch (void* arg) {
     if (ms->num == 0) {
         
         // On prend le premier élt
-        elt = mm->first;
+        elt = Mem_HeadAt(mm->first);
         
-        // Recherche d'un élt correspondant à la taille demandée
-        while (elt != NULL && ((int) elt) <= (((int) mm->first) + (mm->size/2))
-               && (elt->size < ms->size || elt->type == ALLOCATED) && *(ms->sync) == 0) {
-            elt = elt->next;
+        // Recherche d'un élt libre (un bloc en attente ne l'est pas encore) de la taille demandée
+        while (elt != NULL && Mem_HeadOffset(elt) <= mm->first + (mm->size/2)
+               && (elt->size < ms->size || elt->type != EMPTY) && *(ms->sync) == 0) {
+            elt = NEXT(elt);
         }
     }
     // Si on est un thread qui recherche par le bas
     else {
         
         // On prend le dernier élt
-        elt = mm->last;
+        elt = Mem_HeadAt(mm->last);
         
         // Recherche d'un élt correspondant à la taille demandée
-        while (elt != NULL && ((int) elt) >= (((int) mm->last) - (mm->size/2))
-               && (elt->size < ms->size || elt->type == ALLOCATED) && *(ms->sync) == 0) {
-            elt = elt->prev;
+        while (elt != NULL && Mem_HeadOffset(elt) + (mm->size/2) >= mm->last
+               && (elt->size < ms->size || elt->type != EMPTY) && *(ms->sync) == 0) {
+            elt = PREV(elt);
         }
     }
     
@@ -142,7 +759,7 @@ void* Mem_ThreadSearch (void* arg) {
     pthread_exit(NULL);
 }
 
-memory_head* Mem_SearchFree (unsigned int size) {
+memory_head* Mem_SearchFree (size_t size) {
     
     // Init des conf pour les threads
     int sync = 0;
@@ -188,18 +805,18 @@ void* Mem_GetHeader (void* ptr) {
     if (ptr == NULL) return NULL; 
 
     // Si le pointeur est dans les bornes (Après le manager et le premier header du premier bloc et avant la fin du dernier bloc)
-    if (ptr >= ((void*) mm->first + sizeof(memory_head))
-        && ptr <= ((void*) mm->last + sizeof(memory_head) + mm->last->size)) {
+    if (ptr >= ((void*) Mem_HeadAt(mm->first) + sizeof(memory_head))
+        && ptr <= ((void*) Mem_HeadAt(mm->last) + sizeof(memory_head) + Mem_HeadAt(mm->last)->size)) {
         
         // On parcourt un octet par octet en remontant pour trouver le header le plus proche
-        for (int i=0; ; i++) {
+        for (size_t i=0; ; i++) {
             
             memory_head* m = (memory_head*) (ptr-i);
             
-            if (m->serial == 123456) {
+            if (m->serial == MEMORY_SERIAL) {
                 
-                int tmp = ((void*) m) + m->size + sizeof(memory_head);
-                int ptr_tmp = ptr;
+                uintptr_t tmp = (uintptr_t) m + sizeof(memory_head) + m->size;
+                uintptr_t ptr_tmp = (uintptr_t) ptr;
                 
                 // Si le premier header trouvé a le statut ALLOCATED, alors on retourne vrai (1)
                 if (m->type == ALLOCATED
@@ -207,8 +824,8 @@ void* Mem_GetHeader (void* ptr) {
                     && ptr_tmp<tmp) {
                     return m;
                 }
-                // Sinon, si le statut est EMPTY, alors on retourne faux (-1)
-                else if (m->type == EMPTY
+                // Sinon, si le statut est EMPTY (ou en attente), alors on retourne faux (-1)
+                else if (m->type != ALLOCATED
                          && i >= sizeof(memory_head)) {
                     return NULL;
                 }
@@ -218,7 +835,11 @@ void* Mem_GetHeader (void* ptr) {
     return NULL;
 }
 
-int Mem_IsValid (void* ptr) {
+static int Mem_IsValidLocked (void* ptr) {
+    
+    if (memory_table_init != 0) {
+        return Mem_TableFind(ptr) != mt.nb ? 1 : -1;
+    }
     
     // Je cherche une entete correspondant à mon pointeur
     void* tmp = Mem_GetHeader(ptr);
@@ -230,7 +851,12 @@ int Mem_IsValid (void* ptr) {
     return -1;
 }
 
-int Mem_GetSize (void* ptr) {
+static ssize_t Mem_GetSizeLocked (void* ptr) {
+    
+    if (memory_table_init != 0) {
+        size_t i = Mem_TableFind(ptr);
+        return i != mt.nb ? (ssize_t) mt.size[i] : -1;
+    }
     
     // Je cherche une entete correspondant à mon pointeur
     void* tmp = Mem_GetHeader(ptr);
@@ -242,260 +868,1212 @@ int Mem_GetSize (void* ptr) {
     return -1;
 }
 
-int Mem_Free (void* ptr) {
+static int Mem_SetRootLocked (void* ptr) {
     
-    // Je cherche une entete correspondant à mon pointeur
-    void* tmp = Mem_GetHeader(ptr);
+    if (memory_manager_init == 0) {
+        return -1;
+    }
     
-    // Si une entete existe pour cette adresse, je libère
-    if (tmp != NULL) {
+    // Le pointeur racine doit désigner un bloc alloué (ou NULL pour effacer)
+    if (ptr != NULL && Mem_IsValidLocked(ptr) != 1) {
+        return -1;
+    }
+    
+    mm->root = ptr == NULL ? 0 : (size_t) (ptr - (void*) mm);
+    return 0;
+}
+
+static void* Mem_GetRootLocked () {
+    
+    if (memory_manager_init == 0 || mm->root == 0) {
+        return NULL;
+    }
+    return (void*) mm + mm->root;
+}
+
+// Libération effective d'un bloc : fusion avec les voisins EMPTY puis remise
+// à 0 ; les blocs libres étant toujours remplis de 0, seuls le bloc libéré et
+// les entetes absorbées sont effacés
+static int Mem_FreeBlock (memory_head* mh) {
+    
+    memory_head* prev = PREV(mh);
+    memory_head* next = NEXT(mh);
+    size_t size = mh->size;
+    
+    // S'il n'a pas de précédent et pas de suivant
+    if (prev == NULL && next == NULL) {
         
-        // Récupération de l'entete
-        memory_head* mh = (memory_head*) tmp;
+        // On libère le bloc
+        mh->type = EMPTY;
         
-        // S'il n'a pas de précédent et pas de suivant
-        if (mh->prev == NULL && mh->next == NULL) {
-            
-            // On libère le bloc
-            mh->type = EMPTY;
+        // On met à jour le manager
+        mm->nb_empty++;
+        if (mh->size > mm->max_empty) {
+            mm->max_empty = mh->size;
+        }
+        
+        // On ré-initialise le bloc mémoire avec que des 0
+        memset((void*) mh + sizeof(memory_head), 0, mh->size);
+        
+    }
+    // S'il y a un précédent et un suivant EMPTY
+    else if (prev != NULL && prev->type == EMPTY && next != NULL && next->type == EMPTY) {
+        
+        // J'ajoute la taille dans le bloc
+        prev->size += (mh->size + next->size + sizeof(memory_head)*2);
+        
+        // Je fais disparaitre mon bloc courant et le suivant en cassant le serial
+        mh->serial = 0;
+        next->serial = 0;
+        if (mm->compact == Mem_HeadOffset(mh) || mm->compact == mh->next) {
+            mm->compact = mh->prev;
+        }
+        
+        // On met à jour le manager
+        if (prev->size > mm->max_empty) {
+            mm->max_empty = prev->size;
+        }
+        
+        // Je supprime mon bloc de la chaine
+        prev->next = next->next;
+        if (prev->next != 0) {
+            NEXT(prev)->prev = mh->prev;
+        }
+        
+        // On met à jour le manager
+        mm->nb_empty--;
+        if (mh->next == mm->last) {
+            mm->last = mh->prev;
+        }
+        
+        // On ré-initialise le bloc mémoire avec que des 0
+        memset(mh, 0, size + sizeof(memory_head)*2);
+    }
+    // S'il y a un précédent EMPTY
+    else if (prev != NULL && prev->type == EMPTY) {
+        
+        // Je fais disparaitre mon bloc courant en cassant le serial
+        mh->serial = 0;
+        if (mm->compact == Mem_HeadOffset(mh)) {
+            mm->compact = mh->prev;
+        }
+        
+        // On supprime l'entete en ajustant les suivants et les précédents
+        prev->size += (mh->size + sizeof(memory_head));
+        prev->next = mh->next;
+        if (next != NULL) {
+        	next->prev = mh->prev;
+        }
+        
+        // On met à jour le manager
+        if (prev->size > mm->max_empty) {
+            mm->max_empty = prev->size;
+        }
+        if (Mem_HeadOffset(mh) == mm->last) {
+            mm->last = mh->prev;
+        }
+        
+        // On ré-initialise le bloc mémoire avec que des 0
+        memset(mh, 0, size + sizeof(memory_head));
+    }
+    // S'il y a un suivant EMPTY
+    else if (next != NULL && next->type == EMPTY) {
+        
+        // Je fais disparaitre mon bloc suivant du courant en cassant le serial
+        next->serial = 0;
+        if (mm->compact == mh->next) {
+            mm->compact = Mem_HeadOffset(mh);
+        }
+        
+        // On supprime le trou suivant pour fusionner les trous
+        mh->type = EMPTY;
+        mh->size += (next->size + sizeof(memory_head));
+        
+        if (next->next != 0) {
+            NEXT(next)->prev = Mem_HeadOffset(mh);
+        }
+        
+        // Si le suivant absorbé était le dernier, c'est moi qui le deviens
+        if (mh->next == mm->last) {
+            mm->last = Mem_HeadOffset(mh);
+        }
+        
+        mh->next = next->next;
+        
+        // On met à jour le manager
+        if (mh->size > mm->max_empty) {
+            mm->max_empty = mh->size;
+        }
+        
+        // On ré-initialise le bloc mémoire avec que des 0
+        memset((void*) mh + sizeof(memory_head), 0, size + sizeof(memory_head));
+    }
+    // S'il y a un précédant ou/et suivant occupé (alloué ou en attente)
+    else if ((next != NULL && next->type != EMPTY) || (prev != NULL && prev->type != EMPTY)) {
+        mh->type = EMPTY;
+        
+        // On met à jour le manager
+        mm->nb_empty++;
+        if (mh->size > mm->max_empty) {
+            mm->max_empty = mh->size;
+        }
+        
+        // On ré-initialise le bloc mémoire avec que des 0
+        memset((void*) mh + sizeof(memory_head), 0, mh->size);
+    }
+    else {
+        return -1;
+    }
+    
+    return 0;
+}
+
+static int Mem_FreeLocked (void* ptr) {
+    
+    if (memory_table_init != 0) {
+        return Mem_TableFree(ptr);
+    }
+    
+    // Je cherche une entete correspondant à mon pointeur
+    void* tmp = Mem_GetHeader(ptr);
+    
+    // Si une entete existe pour cette adresse, je libère
+    if (tmp != NULL) {
+        
+        // Récupération de l'entete
+        memory_head* mh = (memory_head*) tmp;
+        
+        // La racine ne peut pas survivre à son bloc
+        if (mm->root >= Mem_HeadOffset(mh) + sizeof(memory_head)
+            && mm->root < Mem_HeadOffset(mh) + sizeof(memory_head) + mh->size) {
+            mm->root = 0;
+        }
+        
+        // Un bloc déplaçable libère aussi son handle
+        if (mh->handle != 0) {
+            Mem_HandleTable()[mh->handle-1].block = 0;
+            mh->handle = 0;
+        }
+        
+        // En mode maintenance, le bloc est seulement mis en attente
+        if (memory_maintain_mode != MEMORY_MAINTAIN_OFF && Mem_PendingPush(mh) == 0) {
             
-            // On met à jour le manager
-            mm->nb_empty++;
-            if (mh->size > mm->max_empty) {
-                mm->max_empty = mh->size;
+            // On réveille le thread de maintenance si la file est assez longue
+            if (memory_nb_pending >= MEMORY_PENDING_BATCH) {
+                pthread_cond_signal(&memory_maintain_cond);
             }
+            return 0;
+        }
+        
+        return Mem_FreeBlock(mh);
+    }
+    
+    return -1;
+}
+
+// Libération d'un lot de pointeurs en une seule prise du verrou : les
+// pointeurs invalides sont ignorés et signalés par -1
+static int Mem_FreeBulkLocked (void** ptrs, size_t n) {
+    
+    int res = 0;
+    
+    for (size_t i=0; i<n; i++) {
+        if (Mem_FreeLocked(ptrs[i]) != 0) {
+            res = -1;
+        }
+    }
+    
+    return res;
+}
+
+static int Mem_MaintainLocked () {
+    
+    unsigned int done = memory_nb_pending;
+    
+    if (memory_manager_init == 0) {
+        return 0;
+    }
+    
+    // Fusion des blocs en attente avec leurs voisins libres : Mem_FreeBlock
+    // tient les compteurs à jour, sans reparcourir la chaine
+    for (unsigned int i=0; i<memory_nb_pending; i++) {
+        memory_head* mh = Mem_HeadAt(memory_pending[i]);
+        mh->type = ALLOCATED;
+        Mem_FreeBlock(mh);
+    }
+    memory_nb_pending = 0;
+    
+    return done;
+}
+
+void* Mem_MaintainThread (void* arg) {
+    
+    struct timespec ts;
+    
+    pthread_mutex_lock(&memory_manager_lock);
+    
+    while (memory_maintain_mode == MEMORY_MAINTAIN_THREAD) {
+        
+        // On attend un lot complet ou la fin de la période
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += MEMORY_MAINTAIN_PERIOD * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&memory_maintain_cond, &memory_manager_lock, &ts);
+        
+        if (memory_nb_pending > 0) {
+            Mem_MaintainLocked();
+        }
+        Mem_TuneDueLocked();
+    }
+    
+    pthread_mutex_unlock(&memory_manager_lock);
+    
+    return NULL;
+}
+
+static int Mem_SetMaintenanceLocked (int mode) {
+    
+    if (mode < MEMORY_MAINTAIN_OFF || mode > MEMORY_MAINTAIN_THREAD) {
+        return -1;
+    }
+    
+    // Arrêt du thread de maintenance : il faut relacher le verrou pendant l'attente
+    if (memory_maintain_mode == MEMORY_MAINTAIN_THREAD && mode != MEMORY_MAINTAIN_THREAD) {
+        memory_maintain_mode = mode;
+        pthread_cond_signal(&memory_maintain_cond);
+        pthread_mutex_unlock(&memory_manager_lock);
+        pthread_join(memory_maintain_thread, NULL);
+        pthread_mutex_lock(&memory_manager_lock);
+    }
+    
+    // Démarrage du thread de maintenance
+    if (mode == MEMORY_MAINTAIN_THREAD && memory_maintain_mode != MEMORY_MAINTAIN_THREAD) {
+        memory_maintain_mode = mode;
+        if (pthread_create(&memory_maintain_thread, NULL, Mem_MaintainThread, NULL) != 0) {
+            memory_maintain_mode = MEMORY_MAINTAIN_MANUAL;
+            return -1;
+        }
+    }
+    
+    memory_maintain_mode = mode;
+    
+    // Sans maintenance, plus rien ne doit rester en attente
+    if (mode == MEMORY_MAINTAIN_OFF) {
+        Mem_MaintainLocked();
+    }
+    
+    return 0;
+}
+
+
+
+// Histogramme des tailles demandées (par pas de MEMORY_HISTO_STEP octets) et
+// classes de tailles : une demande est arrondie à la plus petite classe qui la
+// contient, les blocs déjà alloués gardent leur taille
+static void Mem_ClassesRecord (size_t size) {
+    
+    if (size <= MEMORY_HISTO_MAX) {
+        size_t b = size == 0 ? 0 : (size-1)/MEMORY_HISTO_STEP;
+        memory_histo_count[b]++;
+        memory_histo_sum[b] += size;
+    }
+    
+    // Réapprentissage périodique : le calcul est laissé à Mem_Maintain ou au
+    // thread de maintenance pour ne pas bloquer l'allocation en cours
+    if (memory_tune_period != 0 && ++memory_tune_count >= memory_tune_period) {
+        memory_tune_count = 0;
+        memory_tune_due = 1;
+        if (memory_maintain_mode == MEMORY_MAINTAIN_THREAD) {
+            pthread_cond_signal(&memory_maintain_cond);
+        }
+    }
+}
+
+static size_t Mem_ClassesRound (size_t size) {
+    
+    if (memory_nb_classes == 0 || size > memory_classes[memory_nb_classes-1]) {
+        return size;
+    }
+    
+    // Recherche dichotomique de la première classe suffisante
+    unsigned int lo = 0;
+    unsigned int hi = memory_nb_classes-1;
+    
+    while (lo < hi) {
+        unsigned int mid = (lo + hi)/2;
+        if (memory_classes[mid] >= size) {
+            hi = mid;
+        }
+        else {
+            lo = mid+1;
+        }
+    }
+    
+    return memory_classes[lo];
+}
+
+static int Mem_SetClassesLocked (const size_t* classes, unsigned int nb) {
+    
+    if (nb > MEMORY_MAX_CLASSES) {
+        return -1;
+    }
+    
+    // Les classes doivent être strictement croissantes
+    for (unsigned int i=1; i<nb; i++) {
+        if (classes[i] <= classes[i-1]) {
+            return -1;
+        }
+    }
+    
+    memcpy(memory_classes, classes, nb*sizeof(size_t));
+    memory_nb_classes = nb;
+    
+    return 0;
+}
+
+// Calcul des nb classes minimisant la perte sur l'histogramme donné, rangées
+// par ordre croissant dans classes ; retourne leur nombre ou -1
+static int Mem_ClassesCompute (const uint64_t* histo_count, const uint64_t* histo_sum,
+                               unsigned int nb, size_t* classes) {
+    
+    unsigned int idx[MEMORY_HISTO_BUCKETS];
+    uint64_t count[MEMORY_HISTO_BUCKETS+1];
+    uint64_t sum[MEMORY_HISTO_BUCKETS+1];
+    unsigned int n = 0;
+    
+    // Seuls les pas non vides de l'histogramme comptent (sommes préfixes)
+    count[0] = 0;
+    sum[0] = 0;
+    for (unsigned int b=0; b<MEMORY_HISTO_BUCKETS; b++) {
+        if (histo_count[b] != 0) {
+            idx[n] = b;
+            count[n+1] = count[n] + histo_count[b];
+            sum[n+1] = sum[n] + histo_sum[b];
+            n++;
+        }
+    }
+    
+    if (n == 0) {
+        return 0;
+    }
+    if (nb > n) {
+        nb = n;
+    }
+    
+    // cost[c*n+j] : perte minimale pour couvrir les pas 0..j avec c+1 classes,
+    // la dernière classe valant la borne haute du pas j
+    uint64_t* cost = (uint64_t*) malloc(nb*n*sizeof(uint64_t));
+    unsigned int* from = (unsigned int*) malloc(nb*n*sizeof(unsigned int));
+    
+    if (cost == NULL || from == NULL) {
+        free(cost);
+        free(from);
+        return -1;
+    }
+    
+    for (unsigned int j=0; j<n; j++) {
+        uint64_t top = (uint64_t) (idx[j]+1)*MEMORY_HISTO_STEP;
+        cost[j] = top*count[j+1] - sum[j+1];
+        from[j] = 0;
+    }
+    
+    for (unsigned int c=1; c<nb; c++) {
+        for (unsigned int j=0; j<n; j++) {
+            uint64_t top = (uint64_t) (idx[j]+1)*MEMORY_HISTO_STEP;
+            
+            // La classe précédente finit au pas i-1, la nouvelle couvre i..j
+            cost[c*n+j] = cost[(c-1)*n+j];
+            from[c*n+j] = j+1;
+            for (unsigned int i=1; i<=j; i++) {
+                uint64_t v = cost[(c-1)*n+i-1] + top*(count[j+1]-count[i]) - (sum[j+1]-sum[i]);
+                if (v < cost[c*n+j]) {
+                    cost[c*n+j] = v;
+                    from[c*n+j] = i;
+                }
+            }
+        }
+    }
+    
+    // On remonte les choix depuis le dernier pas
+    unsigned int k = 0;
+    unsigned int j = n;
+    
+    for (int c=nb-1; c>=0 && j>0; c--) {
+        unsigned int i = from[c*n+j-1];
+        if (i == j) {
+            continue;
+        }
+        classes[k++] = (size_t) (idx[j-1]+1)*MEMORY_HISTO_STEP;
+        j = i;
+    }
+    
+    free(cost);
+    free(from);
+    
+    // Les classes ont été trouvées de la plus grande à la plus petite
+    for (unsigned int i=0; i<k/2; i++) {
+        size_t tmp = classes[i];
+        classes[i] = classes[k-1-i];
+        classes[k-1-i] = tmp;
+    }
+    
+    return k;
+}
+
+// Vieillissement : les nouvelles demandes pèsent autant que tout le passé
+static void Mem_ClassesAge () {
+    
+    for (unsigned int b=0; b<MEMORY_HISTO_BUCKETS; b++) {
+        memory_histo_count[b] /= 2;
+        memory_histo_sum[b] /= 2;
+    }
+}
+
+static int Mem_TuneClassesLocked (unsigned int nb) {
+    
+    size_t classes[MEMORY_MAX_CLASSES];
+    
+    if (nb == 0 || nb > MEMORY_MAX_CLASSES) {
+        return -1;
+    }
+    
+    int k = Mem_ClassesCompute(memory_histo_count, memory_histo_sum, nb, classes);
+    
+    if (k <= 0) {
+        return k;
+    }
+    
+    Mem_ClassesAge();
+    
+    return Mem_SetClassesLocked(classes, k);
+}
+
+// Réapprentissage périodique en attente : l'histogramme est copié sous le
+// verrou, mais le calcul (des dizaines de ms sur un histogramme plein) est
+// fait verrou relaché pour ne bloquer aucun autre thread
+static void Mem_TuneDueLocked () {
+    
+    uint64_t count[MEMORY_HISTO_BUCKETS];
+    uint64_t sum[MEMORY_HISTO_BUCKETS];
+    size_t classes[MEMORY_MAX_CLASSES];
+    
+    if (memory_tune_due == 0 || memory_tune_period == 0) {
+        return;
+    }
+    
+    memory_tune_due = 0;
+    unsigned int nb = memory_tune_classes;
+    memcpy(count, memory_histo_count, sizeof(count));
+    memcpy(sum, memory_histo_sum, sizeof(sum));
+    
+    pthread_mutex_unlock(&memory_manager_lock);
+    int k = Mem_ClassesCompute(count, sum, nb, classes);
+    pthread_mutex_lock(&memory_manager_lock);
+    
+    // Le réglage a pu être coupé pendant le calcul
+    if (k > 0 && memory_tune_period != 0) {
+        Mem_ClassesAge();
+        Mem_SetClassesLocked(classes, k);
+    }
+}
+
+static int Mem_ExportClassesLocked (int fd) {
+    
+    FILE* f = fdopen(dup(fd), "w");
+    
+    if (f == NULL) {
+        return -1;
+    }
+    
+    // Fichier à passer à la compilation : make CLASSES=<fichier>
+    fprintf(f, "/* Classes de tailles générées par Mem_ExportClasses */\n");
+    fprintf(f, "#define BEMA_NB_CLASSES %u\n", memory_nb_classes);
+    fprintf(f, "#define BEMA_CLASSES {");
+    for (unsigned int i=0; i<memory_nb_classes; i++) {
+        fprintf(f, "%s%zu", i == 0 ? " " : ", ", memory_classes[i]);
+    }
+    fprintf(f, " }\n");
+    
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+static int Mem_SetTuningLocked (size_t period, unsigned int nb) {
+    
+    if (period != 0 && (nb == 0 || nb > MEMORY_MAX_CLASSES)) {
+        return -1;
+    }
+    
+    memory_tune_period = period;
+    memory_tune_classes = nb;
+    memory_tune_count = 0;
+    
+    return 0;
+}
+
+// Placement de size octets dans le bloc libre elt, dont le reste redevient libre
+static void* Mem_AllocAt (memory_head* elt, size_t size) {
+    
+    memory_head* next = NEXT(elt);
+    
+    // Si je possède un suivant et mon suivant est vide (EMPTY)
+    if (next != NULL && next->type == EMPTY) {
+        
+        // Je donne au suivant la quantité que j'ai en trop : son entete
+        // recule d'autant pour que les blocs restent contigus
+        memory_head moved = *next;
+        moved.size += elt->size-size;
+        
+        // L'ancienne entete rejoint la zone libre, qui reste remplie de 0
+        memset(next, 0, sizeof(memory_head));
+        
+        next = (memory_head*) ((void*) elt + sizeof(memory_head) + size);
+        *next = moved;
+        
+        if (next->next != 0) {
+            NEXT(next)->prev = Mem_HeadOffset(next);
+        }
+        if (elt->next == mm->last) {
+            mm->last = Mem_HeadOffset(next);
+        }
+        if (elt->next == mm->compact) {
+            mm->compact = Mem_HeadOffset(next);
+        }
+        elt->next = Mem_HeadOffset(next);
+        
+        // Je change mon statut et j'ajuste la taille de mon bloc par rapport à ce que j'ai donné au suivant
+        elt->type = ALLOCATED;
+        elt->size = size;
+        
+        // Je retourne l'adresse
+        return (void*) elt + sizeof(memory_head);
+    }
+    
+    // Si je ne possède pas de suivant, je dois en créer un si la taille restante me le permet
+    else if (next == NULL) {
+        
+        // Test si nous avons assez de place pour créer le suivant
+        if (elt->size > (size + sizeof(memory_head))) {
+            
+            // On crée un suivant
+            memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + size);
             
-            // On ré-initialise le bloc mémoire avec que des 0
-            memset((void*) mh + sizeof(memory_head), 0, mh->size);
+            mh->type = EMPTY;
+            mh->size = elt->size - size - sizeof(memory_head);
+            mh->prev = Mem_HeadOffset(elt);
+            mh->serial = MEMORY_SERIAL;
+            mh->handle = 0;
+            mh->next = 0;
             
+            // Je change mon statut et j'ajuste la taille de mon bloc par rapport à ce que j'ai donné au suivant
+            elt->type = ALLOCATED;
+            elt->size = size;
+            
+            // On informe à l'élément courant qu'il a maintenant un suivant
+            elt->next = Mem_HeadOffset(mh);
+            
+            // Je mets à jour mon manager concernant le nouveau last
+            mm->last = elt->next;
+        }
+        // Si je n'ai pas la place de faire un suivant, je lui renvoie un peu plus pour éviter de perdre de la mémoire
+        else {
+            // Je change mon statut
+            elt->type = ALLOCATED;
+            
+            // Je préviens mon manager d'un empty de moins
+            mm->nb_empty--;
+        }
+        
+        // Je retourne l'adresse
+        return (void*) elt + sizeof(memory_head);
+    }
+    
+    // Si je possède un suivant et mon suivant est alloué (ALLOCATED) ou en attente
+    else {
+        
+        // Test si nous avons la place de créer un suivant
+        if (elt->size > (size + sizeof(memory_head))) {
+            
+            // On crée un suivant
+            memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + size);
+            mh->type = EMPTY;
+            mh->size = elt->size - size - sizeof(memory_head);
+            mh->prev = Mem_HeadOffset(elt);
+            mh->serial = MEMORY_SERIAL;
+            mh->handle = 0;
+            
+            // Le suivant du nouveau élt est le suivant de l'élt courant
+            mh->next = elt->next;
+                
+            // Le suivant de l'élt a pour précédant le nouveau élt
+            next->prev = Mem_HeadOffset(mh);
+            
+            // On informe à l'élément courant qu'il a un autre suivant
+            elt->next = Mem_HeadOffset(mh);
+            
+            // On a crée un élt suivant EMPTY, donc nous avons comme taille de notre élt courant, la taille demandée
+            elt->size = size;
+        }
+        else {
+            // Le bloc est entièrement donné : un empty de moins
+            mm->nb_empty--;
+        }
+        
+        // Allocation de l'élt trouvé
+        elt->type = ALLOCATED;
+        
+        // On revoit l'adresse du début de bloc alloué
+        return (void*) elt + sizeof(memory_head);
+    }
+}
+
+static void* Mem_AllocBlock (size_t size) {
+    // Init du Mem
+    if (memory_manager_init == 0) {
+        
+        // Init Mem
+        if (Mem_InitLocked(10000, NULL) < 0) {
+            return NULL;
+        }
+    }
+    
+    // Une taille plus grande que la région est refusée : les calculs
+    // size + sizeof(memory_head) qui suivent ne peuvent donc pas déborder
+    if (size > mm->size) {
+        return NULL;
+    }
+    
+    // Test préliminaire (première élimination des possibilités)
+    if (mm->nb_empty > 0 && mm->max_empty > size) {
+        
+        // On cherche un elt libre
+        memory_head* elt = Mem_SearchFree(size);
+        
+        // On ne trouve pas d'élément libre, on retourne NULL
+        if (elt == NULL) {
+            return NULL;
+        }
+        
+        return Mem_AllocAt(elt, size);
+    }
+    
+    return NULL;
+}
+
+// Placement normal d'une taille déjà arrondie à sa classe
+static void* Mem_AllocFirst (size_t size) {
+    
+    if (memory_table_init != 0) {
+        return Mem_TableAlloc(size);
+    }
+    
+    void* ptr = Mem_AllocBlock(size);
+    
+    // Rien ne convient : on fusionne tout de suite les blocs en attente et on réessaie
+    if (ptr == NULL && memory_nb_pending > 0) {
+        Mem_MaintainLocked();
+        ptr = Mem_AllocBlock(size);
+    }
+    
+    return ptr;
+}
+
+static void* Mem_AllocLocked (size_t size) {
+    
+    // Apprentissage de la taille demandée puis arrondi à sa classe
+    Mem_ClassesRecord(size);
+    size = Mem_ClassesRound(size);
+    
+    return Mem_AllocFirst(size);
+}
+
+// Bloc libre d'au moins size octets le plus proche de mh, cherché parmi ses
+// voisins (MEMORY_NEAR_SPAN blocs à moins de MEMORY_NEAR_WINDOW octets de
+// chaque côté), NULL si aucun
+static memory_head* Mem_SearchNear (memory_head* mh, size_t size) {
+    
+    memory_head* best = NULL;
+    size_t best_dist = MEMORY_NEAR_WINDOW;
+    void* end = (void*) mh + sizeof(memory_head) + mh->size;
+    memory_head* elt = NEXT(mh);
+    
+    // Vers la fin de la région : le premier qui convient est le plus proche
+    for (int i=0; elt != NULL && i < MEMORY_NEAR_SPAN; i++, elt = NEXT(elt)) {
+        
+        size_t dist = (void*) elt - end;
+        if (dist >= best_dist) {
+            break;
+        }
+        if (elt->type == EMPTY && elt->size >= size) {
+            best = elt;
+            best_dist = dist;
+            break;
+        }
+    }
+    
+    // Vers le début : on ne garde un bloc que s'il est plus proche que celui d'après
+    elt = PREV(mh);
+    for (int i=0; elt != NULL && i < MEMORY_NEAR_SPAN; i++, elt = PREV(elt)) {
+        
+        size_t dist = (void*) mh - ((void*) elt + sizeof(memory_head) + elt->size);
+        if (dist >= best_dist) {
+            break;
+        }
+        if (elt->type == EMPTY && elt->size >= size) {
+            best = elt;
+            break;
+        }
+    }
+    
+    return best;
+}
+
+// Placement de size octets à la fin du bloc libre elt, collé à son suivant
+static void* Mem_AllocTail (memory_head* elt, size_t size) {
+    
+    // Sans la place pour une nouvelle entete, tout le bloc est donné
+    if (elt->size <= size + sizeof(memory_head)) {
+        return Mem_AllocAt(elt, size);
+    }
+    
+    elt->size -= size + sizeof(memory_head);
+    
+    // Le nouveau bloc est pris dans un trou rempli de 0
+    memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + elt->size);
+    mh->type = ALLOCATED;
+    mh->size = size;
+    mh->serial = MEMORY_SERIAL;
+    mh->handle = 0;
+    mh->prev = Mem_HeadOffset(elt);
+    mh->next = elt->next;
+    
+    if (mh->next != 0) {
+        NEXT(mh)->prev = Mem_HeadOffset(mh);
+    }
+    else {
+        mm->last = Mem_HeadOffset(mh);
+    }
+    elt->next = Mem_HeadOffset(mh);
+    
+    return (void*) mh + sizeof(memory_head);
+}
+
+static void* Mem_AllocNearLocked (size_t size, void* hint) {
+    
+    Mem_ClassesRecord(size);
+    size = Mem_ClassesRound(size);
+    
+    if (memory_table_init != 0) {
+        return Mem_TableAllocNear(size, hint);
+    }
+    
+    // L'indice doit être un bloc alloué du tas, sinon placement normal
+    if (memory_manager_init != 0 && size <= mm->size) {
+        
+        memory_head* mh = Mem_GetHeader(hint);
+        memory_head* elt = mh == NULL ? NULL : Mem_SearchNear(mh, size);
+        
+        // Un trou avant l'indice est pris par sa fin, un trou après par son début
+        if (elt != NULL) {
+            return elt < mh ? Mem_AllocTail(elt, size) : Mem_AllocAt(elt, size);
+        }
+    }
+    
+    return Mem_AllocFirst(size);
+}
+
+static void* Mem_AllocAlignedLocked (size_t size, size_t align) {
+    
+    size_t total;
+    
+    // L'alignement doit être une puissance de 2
+    if (align == 0 || (align & (align-1)) != 0) {
+        return NULL;
+    }
+    
+    // Une demande de 0 octet (légale pour les adaptateurs C++) prend un octet :
+    // Mem_Free ne sait pas retrouver un bloc vide depuis son pointeur
+    if (size == 0) {
+        size = 1;
+    }
+    
+    // En mode table, les données sont déjà alignées sur le grain
+    if (memory_table_init != 0 && align <= MEMORY_TABLE_GRAIN) {
+        return Mem_AllocLocked(size);
+    }
+    
+    // Sinon on demande align-1 octets de plus et on rend un pointeur intérieur,
+    // que Mem_Free sait retrouver
+    if (__builtin_add_overflow(size, align-1, &total)) {
+        return NULL;
+    }
+    
+    void* ptr = Mem_AllocLocked(total);
+    
+    if (ptr == NULL) {
+        return NULL;
+    }
+    
+    return (void*) (((uintptr_t) ptr + align-1) & ~((uintptr_t) align-1));
+}
+
+static void* Mem_CallocLocked (size_t nmemb, size_t size) {
+    
+    size_t total;
+    
+    // Débordement de nmemb*size
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        return NULL;
+    }
+    
+    // Tout bloc EMPTY est tenu rempli de 0 (Mem_FreeBlock, fusions et
+    // compactage effacent ce qu'ils rendent), en ligne comme en mode table :
+    // le bloc alloué est donc rendu tel quel
+    return Mem_AllocLocked(total);
+}
+
+static unsigned int Mem_AllocHandleLocked (size_t size) {
+    
+    unsigned int h = 0;
+    
+    // Pas de handles en mode table : la table des handles vit dans la région
+    if (memory_table_init != 0) {
+        return 0;
+    }
+    
+    // On alloue le bloc comme un bloc classique
+    void* ptr = Mem_AllocLocked(size);
+    
+    if (ptr == NULL) {
+        return 0;
+    }
+    
+    // On cherche une entrée libre dans la table des handles
+    while (h < mm->nb_handles && Mem_HandleTable()[h].block != 0) {
+        h++;
+    }
+    
+    // Table pleine : on la double (elle vit elle-même dans la région, sur un bloc fixe)
+    if (h == mm->nb_handles) {
+        
+        size_t nb = mm->nb_handles == 0 ? 64 : mm->nb_handles*2;
+        memory_handle* table = (memory_handle*) Mem_AllocLocked(nb*sizeof(memory_handle));
+        
+        if (table == NULL) {
+            Mem_FreeLocked(ptr);
+            return 0;
+        }
+        
+        memset(table, 0, nb*sizeof(memory_handle));
+        
+        if (mm->handles != 0) {
+            memcpy(table, Mem_HandleTable(), mm->nb_handles*sizeof(memory_handle));
+            Mem_FreeLocked(Mem_HandleTable());
+        }
+        
+        mm->handles = (size_t) ((void*) table - (void*) mm);
+        mm->nb_handles = nb;
+    }
+    
+    // On relie le bloc et son entrée
+    memory_head* mh = (memory_head*) (ptr - sizeof(memory_head));
+    mh->handle = h+1;
+    Mem_HandleTable()[h].block = Mem_HeadOffset(mh);
+    Mem_HandleTable()[h].lock = 0;
+    
+    return h+1;
+}
+
+memory_handle* Mem_HandleGet (unsigned int h) {
+    
+    if (memory_manager_init == 0 || h == 0 || h > mm->nb_handles
+        || Mem_HandleTable()[h-1].block == 0) {
+        return NULL;
+    }
+    return &Mem_HandleTable()[h-1];
+}
+
+static void* Mem_DerefLocked (unsigned int h) {
+    
+    memory_handle* mh = Mem_HandleGet(h);
+    
+    // L'adresse n'est valable que jusqu'au prochain compactage si le bloc n'est pas verrouillé
+    if (mh == NULL) {
+        return NULL;
+    }
+    return (void*) mm + mh->block + sizeof(memory_head);
+}
+
+static void* Mem_LockLocked (unsigned int h) {
+    
+    memory_handle* mh = Mem_HandleGet(h);
+    
+    if (mh == NULL) {
+        return NULL;
+    }
+    
+    // Un bloc verrouillé n'est jamais déplacé par le compacteur
+    mh->lock++;
+    return (void*) mm + mh->block + sizeof(memory_head);
+}
+
+static int Mem_UnlockLocked (unsigned int h) {
+    
+    memory_handle* mh = Mem_HandleGet(h);
+    
+    if (mh == NULL || mh->lock == 0) {
+        return -1;
+    }
+    
+    mh->lock--;
+    return 0;
+}
+
+static int Mem_FreeHandleLocked (unsigned int h) {
+    
+    memory_handle* mh = Mem_HandleGet(h);
+    
+    // On refuse de libérer un bloc encore verrouillé
+    if (mh == NULL || mh->lock != 0) {
+        return -1;
+    }
+    return Mem_FreeLocked(Mem_DerefLocked(h));
+}
+
+static int Mem_CompactLocked (size_t budget) {
+    
+    if (memory_manager_init == 0) {
+        return -1;
+    }
+    
+    // On reprend là où la tranche précédente s'est arrêtée
+    memory_head* elt = Mem_HeadAt(mm->compact != 0 ? mm->compact : mm->first);
+    size_t cost = 0;
+    
+    while (cost < budget) {
+        
+        memory_head* next = NEXT(elt);
+        cost += sizeof(memory_head);
+        
+        // Fin de la chaine : la passe est terminée (les compteurs ont été
+        // tenus à jour au fil des fusions, sans reparcourir la chaine)
+        if (next == NULL) {
+            mm->compact = 0;
+            return 1;
         }
-        // S'il y a un précédent et un suivant EMPTY
-        else if (mh->prev != NULL && mh->prev->type == EMPTY && mh->next != NULL && mh->next->type == EMPTY) {
-            
-            // J'ajoute la taille dans le bloc
-            mh->prev->size += (mh->size + mh->next->size + sizeof(memory_head)*2);
-            
-            // Je fais disparaitre mon bloc courant et le suivant en cassant le serial
-            mh->serial = 0;
-            mh->next->serial = 0;
+        
+        // Deux trous consécutifs : on les fusionne
+        if (elt->type == EMPTY && next->type == EMPTY) {
             
-            // On met à jour le manager
-            if (mh->prev->size > mm->max_empty) {
-                mm->max_empty = mh->prev->size;
+            elt->size += next->size + sizeof(memory_head);
+            elt->next = next->next;
+            if (elt->next != 0) {
+                NEXT(elt)->prev = Mem_HeadOffset(elt);
             }
-            
-            // Je supprime mon bloc de la chaine
-            mh->prev->next = mh->next->next;
-            if (mh->prev->next != NULL) {
-                mh->prev->next->prev = mh->prev;
+            if (Mem_HeadOffset(next) == mm->last) {
+                mm->last = Mem_HeadOffset(elt);
             }
-            
-            // On met à jour le manager
+            memset(next, 0, sizeof(memory_head));
             mm->nb_empty--;
-            if (mh->next == mm->last) {
-                mm->last = mh->prev;
+            if (elt->size > mm->max_empty) {
+                mm->max_empty = elt->size;
             }
-            
-            // On ré-initialise le bloc mémoire avec que des 0
-            memset((void*) mh->prev + sizeof(memory_head), 0, mh->prev->size);
+            continue;
         }
-        // S'il y a un précédent EMPTY
-        else if (mh->prev != NULL && mh->prev->type == EMPTY) {
-            
-            // Je fais disparaitre mon bloc courant en cassant le serial
-            mh->serial = 0;
+        
+        // Un trou suivi d'un bloc déplaçable non verrouillé, ou de la table des
+        // handles elle-même : on fait glisser le bloc vers le bas
+        if (elt->type == EMPTY && next->type == ALLOCATED
+            && ((next->handle != 0 && Mem_HandleTable()[next->handle-1].lock == 0)
+                || Mem_HeadOffset(next) + sizeof(memory_head) == mm->handles)) {
             
-            // On supprime l'entete en ajustant les suivants et les précédents
-            mh->prev->size += (mh->size + sizeof(memory_head));
-            mh->prev->next = mh->next;
-            if (mh->next != NULL) {
-            	mh->next->prev = mh->prev;
+            // Un bloc plus grand que le reste du budget attend la tranche
+            // suivante, où il est déplacé seul
+            if (cost > sizeof(memory_head) && cost + next->size > budget) {
+                mm->compact = Mem_HeadOffset(elt);
+                return 0;
             }
             
-            // On met à jour le manager
-            if (mh->prev->size > mm->max_empty) {
-                mm->max_empty = mh->prev->size;
-            }
-            if (mh == mm->last) {
-                mm->last = mh->prev;
-            }
+            size_t hole = elt->size;
+            size_t from = Mem_HeadOffset(next);
+            size_t to = Mem_HeadOffset(elt);
+            size_t prev = elt->prev;
+            size_t after = next->next;
             
-            // On ré-initialise le bloc mémoire avec que des 0
-            memset((void*) mh->prev + sizeof(memory_head), 0, mh->prev->size);
-        }
-        // S'il y a un suivant EMPTY
-        else if (mh->next != NULL && mh->next->type == EMPTY) {
+            cost += next->size;
             
-            // Je fais disparaitre mon bloc suivant du courant en cassant le serial
-            mh->next->serial = 0;
+            // Le bloc (entete + données) prend la place du trou
+            memmove(elt, next, sizeof(memory_head) + next->size);
+            elt->prev = prev;
             
-            // On supprime le trou suivant pour fusionner les trous
+            // Le trou est recréé juste après : seuls les octets laissés par
+            // l'ancienne position du bloc sont à remettre à 0
+            memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + elt->size);
+            void* stale = (void*) mm + from > (void*) mh ? (void*) mm + from : (void*) mh;
+            memset(stale, 0, (void*) mh + sizeof(memory_head) + hole - stale);
             mh->type = EMPTY;
-            mh->size += (mh->next->size + sizeof(memory_head));
+            mh->size = hole;
+            mh->serial = MEMORY_SERIAL;
+            mh->handle = 0;
+            mh->prev = to;
+            mh->next = after;
             
-            if (mh->next->next != NULL) {
-                mh->next->next->prev = mh;
+            elt->next = Mem_HeadOffset(mh);
+            if (after != 0) {
+                Mem_HeadAt(after)->prev = elt->next;
+            }
+            if (from == mm->last) {
+                mm->last = elt->next;
             }
             
-            mh->next = mh->next->next;
-            
-            // On met à jour le manager
-            if (mh->size > mm->max_empty) {
-                mm->max_empty = mh->size;
+            // Le handle (ou la table) et la racine suivent le bloc
+            if (elt->handle != 0) {
+                Mem_HandleTable()[elt->handle-1].block = to;
             }
-            if (mh->next == mm->last) {
-                mm->last = mh;
+            else {
+                mm->handles = to + sizeof(memory_head);
             }
-            
-            // On ré-initialise le bloc mémoire avec que des 0
-            memset((void*) mh + sizeof(memory_head), 0, mh->size);
-        }
-        // S'il y a un précédant ou/et suivant alloué
-        else if ((mh->next!=NULL && mh->next->type == ALLOCATED) || (mh->prev != NULL && mh->prev->type == ALLOCATED)) {
-            mh->type = EMPTY;
-            
-            // On met à jour le manager
-            mm->nb_empty++;
-            if (mh->size > mm->max_empty) {
-                mm->max_empty = mh->size;
+            if (mm->root > from && mm->root <= from + sizeof(memory_head) + elt->size) {
+                mm->root -= from - to;
             }
             
-            // On ré-initialise le bloc mémoire avec que des 0
-            memset((void*) mh + sizeof(memory_head), 0, mh->size);
+            elt = mh;
+            mm->compact = Mem_HeadOffset(elt);
+            continue;
         }
-        else {
-            return -1;
-        }
-        
-        return 0;
         
+        elt = next;
+        mm->compact = Mem_HeadOffset(elt);
     }
     
-    return -1;
+    return 0;
 }
 
-
-
-void* Mem_Alloc (unsigned int size) {
-    // Init du Mem
+static void Mem_StatsLocked (size_t* nb_empty, size_t* max_empty, size_t* footprint) {
+    
+    *nb_empty = 0;
+    *max_empty = 0;
+    *footprint = 0;
+    
+    if (memory_table_init != 0) {
+        Mem_TableStats(nb_empty, max_empty, footprint);
+        return;
+    }
     if (memory_manager_init == 0) {
-        
-        // Init Mem
-        Mem_Init(10000);
+        return;
     }
     
-    // Test préliminaire (première élimination des possibilités)
-    if (mm->nb_empty > 0 && mm->max_empty > size) {
-        
-        // On cherche un elt libre
-        memory_head* elt = Mem_SearchFree(size);
-        
-        // On ne trouve pas d'élément libre, on retourne NULL
-        if (elt == NULL) {
-            return NULL;
+    memory_head* elt = Mem_HeadAt(mm->first);
+    
+    // L'empreinte est la fin du dernier bloc alloué
+    while (elt != NULL) {
+        if (elt->type == EMPTY) {
+            (*nb_empty)++;
+            if (elt->size > *max_empty) {
+                *max_empty = elt->size;
+            }
+        }
+        else {
+            *footprint = Mem_HeadOffset(elt) + sizeof(memory_head) + elt->size;
         }
+        elt = NEXT(elt);
+    }
+}
+
+// Copie de la liste des blocs pour Mem_Snapshot dans *out (à libérer par
+// l'appelant), -1 si le tas n'est pas initialisé ou si la copie ne peut pas
+// être allouée
+static int Mem_SnapshotLocked (bema_snapshot_header* sh, bema_snapshot_block** out) {
+    
+    bema_snapshot_block* blocks = NULL;
+    size_t max = 0;
+    struct timespec ts;
+    
+    clock_gettime(CLOCK_REALTIME, &ts);
+    
+    memset(sh, 0, sizeof(bema_snapshot_header));
+    sh->magic = BEMA_SNAPSHOT_MAGIC;
+    sh->version = BEMA_SNAPSHOT_VERSION;
+    sh->time = (unsigned long long) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+    
+    if (memory_table_init != 0) {
         
-        // Si je possède un suivant et mon suivant est vide (EMPTY)
-        if (elt->next != NULL && (elt->next)->type == EMPTY) {
-            
-            // Je donne au suivant la quantité que j'ai en trop
-            (elt->next)->size += elt->size-size;
-            
-            // Je change mon statut et j'ajuste la taille de mon bloc par rapport à ce que j'ai donné au suivant
-            elt->type = ALLOCATED;
-            elt->size = size;
-            
-            // Je retourne l'adresse
-            return (void*) elt + sizeof(memory_head);
+        sh->region = mt.region;
+        blocks = (bema_snapshot_block*) malloc(mt.nb*sizeof(bema_snapshot_block));
+        if (blocks == NULL) {
+            return -1;
         }
         
-        // Si je ne possède pas de suivant, je dois en créer un si la taille restante me le permet
-        else if (elt->next == NULL) {
-            
-            // Test si nous avons assez de place pour créer le suivant
-            if (elt->size > (size + sizeof(memory_head))) {
-                
-                // On crée un suivant
-                memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + size);
-                
-                mh->type = EMPTY;
-                mh->size = elt->size - size - sizeof(memory_head);
-                mh->prev = elt;
-                mh->serial = 123456;
-                mh->next = NULL;
-                
-                // Je change mon statut et j'ajuste la taille de mon bloc par rapport à ce que j'ai donné au suivant
-                elt->type = ALLOCATED;
-                elt->size = size;
-                
-                // On informe à l'élément courant qu'il a maintenant un suivant
-                elt->next = mh;
-                
-                // Je mets à jour mon manager concernant le nouveau last
-                mm->last = mh;
-            }
-            // Si je n'ai pas la place de faire un suivant, je lui renvoie un peu plus pour éviter de perdre de la mémoire
-            else {
-                // Je change mon statut
-                elt->type = ALLOCATED;
-                
-                // Je préviens mon manager d'un empty de moins
-                mm->nb_empty--;
-            }
-            
-            // Je retourne l'adresse
-            return (void*) elt + sizeof(memory_head);
+        for (size_t i=0; i<mt.nb; i++) {
+            blocks[i].offset = mt.offset[i];
+            blocks[i].size_state = (unsigned long long) mt.size[i] << 2
+                | (mt.state[i] == EMPTY ? BEMA_SNAPSHOT_EMPTY : BEMA_SNAPSHOT_ALLOCATED);
         }
+        sh->nb_blocks = mt.nb;
+        *out = blocks;
+        return 0;
+    }
+    
+    if (memory_manager_init == 0) {
+        return -1;
+    }
+    
+    sh->region = mm->region;
+    sh->head_size = sizeof(memory_head);
+    
+    // On ne fait que recopier les entetes : aucune écriture tant que le verrou est tenu
+    for (memory_head* elt = Mem_HeadAt(mm->first); elt != NULL; elt = NEXT(elt)) {
         
-        // Si je possède un suivant et mon suivant est alloué (ALLOCATED)
-        else if (elt->next != NULL && ((memory_head*) elt->next)->type == ALLOCATED) {
-            
-            // Test si nous avons la place de créer un suivant
-            if (elt->size > (size + sizeof(memory_head))) {
-                
-                // On crée un suivant
-                memory_head* mh = (memory_head*) ((void*) elt + sizeof(memory_head) + size);
-                mh->type = EMPTY;
-                mh->size = elt->size - size - sizeof(memory_head);
-                mh->prev = elt;
-                mh->serial = 123456;
-                
-                // Le suivant du nouveau élt est le suivant de l'élt courant
-                mh->next = elt->next;
-                    
-                // Le suivant de l'élt a pour précédant le nouveau élt
-                ((memory_head*) elt->next)->prev = mh;
-                
-                // On informe à l'élément courant qu'il a un autre suivant
-                elt->next = mh;
-                
-                // On a crée un élt suivant EMPTY, donc nous avons comme taille de notre élt courant, la taille demandée
-                elt->size = size;
+        if (sh->nb_blocks == max) {
+            max = max == 0 ? 1024 : max*2;
+            bema_snapshot_block* tmp = (bema_snapshot_block*) realloc(blocks, max*sizeof(bema_snapshot_block));
+            if (tmp == NULL) {
+                free(blocks);
+                return -1;
             }
-            
-            // Allocation de l'élt trouvé
-            elt->type = ALLOCATED;
-            
-            // On revoit l'adresse du début de bloc alloué
-            return (void*) elt + sizeof(memory_head);
+            blocks = tmp;
         }
+        
+        blocks[sh->nb_blocks].offset = Mem_HeadOffset(elt);
+        blocks[sh->nb_blocks].size_state = (unsigned long long) elt->size << 2
+            | (elt->type == EMPTY ? BEMA_SNAPSHOT_EMPTY
+               : elt->type == PENDING ? BEMA_SNAPSHOT_PENDING : BEMA_SNAPSHOT_ALLOCATED);
+        sh->nb_blocks++;
     }
     
-    return NULL;
+    *out = blocks;
+    return 0;
+}
+
+// Ecriture complète d'un tampon (write peut n'en écrire qu'une partie)
+static int Mem_WriteAll (int fd, const void* buf, size_t len) {
+    
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            perror("write");
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
 }
 
 void Mem_MemoryHeadPrint (memory_head* mh) {
     printf("---    ADD : %12p ---\n", mh);
-    printf("---   PREV : %12p ---\n", mh->prev);
+    printf("---   PREV : %12p ---\n", PREV(mh));
     printf("--- SERIAL : %12d ---\n", mh->serial);
-    printf("---   SIZE : %12d ---\n", mh->size);
+    printf("---   SIZE : %12zu ---\n", mh->size);
     if (mh->type == EMPTY) {
         printf("---   TYPE :        EMPTY ---\n");
     }
     else if (mh->type == ALLOCATED) {
         printf("---   TYPE :    ALLOCATED ---\n");
     }
-    printf("---   NEXT : %12p ---\n", mh->next);
+    printf("---   NEXT : %12p ---\n", NEXT(mh));
     printf("-----------------------------\n");
 
 }
@@ -507,11 +2085,429 @@ void Mem_MemoryPrint () {
     printf("--------- Memory ------------\n");
     printf("-----------------------------\n");
 
-    memory_head* elt = mm->first;
+    memory_head* elt = Mem_HeadAt(mm->first);
     
     while (elt != NULL) {
         Mem_MemoryHeadPrint(elt);
-        elt = elt->next;
+        elt = NEXT(elt);
     }
     printf("\n");
 }
+
+
+// Points d'entrée publics : chaque appel est sérialisé par le verrou du manager
+
+int Mem_Check () {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_CheckLocked();
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_Init (size_t size, const char* path) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_InitLocked(size, path);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_InitTable (size_t size) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_InitTableLocked(size);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_Sync () {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SyncLocked();
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_IsValid (void* ptr) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_IsValidLocked(ptr);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+ssize_t Mem_GetSize (void* ptr) {
+    pthread_mutex_lock(&memory_manager_lock);
+    ssize_t res = Mem_GetSizeLocked(ptr);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_SetRoot (void* ptr) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SetRootLocked(ptr);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+void* Mem_GetRoot () {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_GetRootLocked();
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+int Mem_Free (void* ptr) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_FreeLocked(ptr);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_FreeBulk (void** ptrs, size_t n) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_FreeBulkLocked(ptrs, n);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+void* Mem_Alloc (size_t size) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_AllocLocked(size);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+void* Mem_AllocNear (size_t size, void* hint) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_AllocNearLocked(size, hint);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+void* Mem_AllocAligned (size_t size, size_t align) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_AllocAlignedLocked(size, align);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+void* Mem_Calloc (size_t nmemb, size_t size) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_CallocLocked(nmemb, size);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+int Mem_SetClasses (const size_t* classes, unsigned int nb) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SetClassesLocked(classes, nb);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_TuneClasses (unsigned int nb) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_TuneClassesLocked(nb);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_SetTuning (size_t period, unsigned int nb) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SetTuningLocked(period, nb);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_ExportClasses (int fd) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_ExportClassesLocked(fd);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_Maintain () {
+    pthread_mutex_lock(&memory_manager_lock);
+    Mem_TuneDueLocked();
+    int res = Mem_MaintainLocked();
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_SetMaintenance (int mode) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SetMaintenanceLocked(mode);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+unsigned int Mem_AllocHandle (size_t size) {
+    pthread_mutex_lock(&memory_manager_lock);
+    unsigned int res = Mem_AllocHandleLocked(size);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+void* Mem_Deref (unsigned int h) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_DerefLocked(h);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+void* Mem_Lock (unsigned int h) {
+    pthread_mutex_lock(&memory_manager_lock);
+    void* ptr = Mem_LockLocked(h);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return ptr;
+}
+
+int Mem_Unlock (unsigned int h) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_UnlockLocked(h);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_FreeHandle (unsigned int h) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_FreeHandleLocked(h);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+int Mem_Compact (size_t budget) {
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_CompactLocked(budget);
+    pthread_mutex_unlock(&memory_manager_lock);
+    return res;
+}
+
+void Mem_Stats (size_t* nb_empty, size_t* max_empty, size_t* footprint) {
+    pthread_mutex_lock(&memory_manager_lock);
+    Mem_StatsLocked(nb_empty, max_empty, footprint);
+    pthread_mutex_unlock(&memory_manager_lock);
+}
+
+// Le verrou n'est tenu que pendant la copie des entetes, l'écriture se fait sans lui
+int Mem_Snapshot (int fd) {
+    
+    bema_snapshot_header sh;
+    bema_snapshot_block* blocks = NULL;
+    
+    pthread_mutex_lock(&memory_manager_lock);
+    int res = Mem_SnapshotLocked(&sh, &blocks);
+    pthread_mutex_unlock(&memory_manager_lock);
+    
+    if (res < 0) {
+        return -1;
+    }
+    
+    res = Mem_WriteAll(fd, &sh, sizeof(sh));
+    if (res == 0 && sh.nb_blocks != 0) {
+        res = Mem_WriteAll(fd, blocks, sh.nb_blocks*sizeof(bema_snapshot_block));
+    }
+    
+    free(blocks);
+    return res;
+}
+
+// Récupération par époques pour les structures sans verrou : un bloc retiré
+// par Mem_FreeDeferred n'est rendu au tas qu'une fois que tous les threads
+// entrés en section critique avant son retrait en sont sortis. Ces fonctions
+// ne prennent pas le verrou du manager, sauf pour la libération des lots.
+
+// Nombre de blocs retirés entre deux tentatives de récupération
+#define MEMORY_EPOCH_BATCH 64
+
+// Etat d'un thread : époque vue à l'entrée (0 hors section critique) et
+// blocs retirés, rangés par époque de retrait croissante
+typedef struct memory_epoch_thread {
+    unsigned long epoch;
+    unsigned int nesting;
+    int used;
+    void** retired;
+    unsigned long* retired_epoch;
+    size_t nb_retired;
+    size_t max_retired;
+    // Blocs retirés depuis la dernière tentative de récupération
+    size_t since_reclaim;
+    struct memory_epoch_thread* next;
+} memory_epoch_thread;
+
+// Epoque globale (commence à 1) et liste des états, qui ne sont jamais libérés
+unsigned long memory_epoch = 1;
+memory_epoch_thread* memory_epoch_threads = NULL;
+
+static __thread memory_epoch_thread* memory_epoch_self = NULL;
+static pthread_key_t memory_epoch_key;
+static pthread_once_t memory_epoch_once = PTHREAD_ONCE_INIT;
+
+static void Mem_EpochRelease (void* arg);
+
+static void Mem_EpochKeyInit () {
+    pthread_key_create(&memory_epoch_key, Mem_EpochRelease);
+}
+
+// Etat du thread courant : on reprend un état abandonné (avec ses blocs en
+// attente) ou on en ajoute un à la liste
+static memory_epoch_thread* Mem_EpochThread () {
+    
+    if (memory_epoch_self != NULL) {
+        return memory_epoch_self;
+    }
+    
+    pthread_once(&memory_epoch_once, Mem_EpochKeyInit);
+    
+    memory_epoch_thread* et = __atomic_load_n(&memory_epoch_threads, __ATOMIC_ACQUIRE);
+    for (; et != NULL; et = et->next) {
+        int unused = 0;
+        if (__atomic_compare_exchange_n(&et->used, &unused, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    
+    if (et == NULL) {
+        
+        et = (memory_epoch_thread*) calloc(1, sizeof(memory_epoch_thread));
+        if (et == NULL) {
+            return NULL;
+        }
+        et->used = 1;
+        
+        // Ajout en tete, visible des autres threads une fois complet
+        et->next = __atomic_load_n(&memory_epoch_threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&memory_epoch_threads, &et->next, et, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    
+    memory_epoch_self = et;
+    pthread_setspecific(memory_epoch_key, et);
+    
+    return et;
+}
+
+// Fin d'un thread : ses blocs encore en attente restent dans son état et
+// seront récupérés par le prochain thread qui le reprend
+static void Mem_EpochRelease (void* arg) {
+    
+    memory_epoch_thread* et = (memory_epoch_thread*) arg;
+    
+    et->nesting = 0;
+    __atomic_store_n(&et->epoch, 0, __ATOMIC_RELEASE);
+    
+    memory_epoch_self = et;
+    Mem_EpochReclaim();
+    memory_epoch_self = NULL;
+    
+    __atomic_store_n(&et->used, 0, __ATOMIC_RELEASE);
+}
+
+int Mem_EpochEnter () {
+    
+    memory_epoch_thread* et = Mem_EpochThread();
+    
+    if (et == NULL) {
+        return -1;
+    }
+    
+    // L'époque est publiée avant toute lecture de la section critique
+    if (et->nesting++ == 0) {
+        __atomic_store_n(&et->epoch, __atomic_load_n(&memory_epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    
+    return 0;
+}
+
+int Mem_EpochExit () {
+    
+    memory_epoch_thread* et = memory_epoch_self;
+    
+    if (et == NULL || et->nesting == 0) {
+        return -1;
+    }
+    
+    if (--et->nesting == 0) {
+        __atomic_store_n(&et->epoch, 0, __ATOMIC_RELEASE);
+    }
+    
+    return 0;
+}
+
+// Libère les blocs du thread courant retirés avant l'époque de tous les
+// threads en section critique, retourne le nombre de blocs encore en attente
+size_t Mem_EpochReclaim () {
+    
+    memory_epoch_thread* et = memory_epoch_self;
+    
+    if (et == NULL || et->nb_retired == 0) {
+        return 0;
+    }
+    
+    et->since_reclaim = 0;
+    
+    // On avance l'époque : les sections critiques ouvertes ensuite ne
+    // peuvent plus voir les blocs déjà retirés
+    unsigned long min = __atomic_add_fetch(&memory_epoch, 1, __ATOMIC_SEQ_CST);
+    
+    for (memory_epoch_thread* it = __atomic_load_n(&memory_epoch_threads, __ATOMIC_ACQUIRE); it != NULL; it = it->next) {
+        unsigned long e = __atomic_load_n(&it->epoch, __ATOMIC_SEQ_CST);
+        if (e != 0 && e < min) {
+            min = e;
+        }
+    }
+    
+    size_t n = 0;
+    while (n < et->nb_retired && et->retired_epoch[n] < min) {
+        n++;
+    }
+    
+    if (n > 0) {
+        Mem_FreeBulk(et->retired, n);
+        
+        et->nb_retired -= n;
+        memmove(et->retired, et->retired + n, et->nb_retired*sizeof(void*));
+        memmove(et->retired_epoch, et->retired_epoch + n, et->nb_retired*sizeof(unsigned long));
+    }
+    
+    return et->nb_retired;
+}
+
+int Mem_FreeDeferred (void* ptr) {
+    
+    memory_epoch_thread* et = Mem_EpochThread();
+    
+    if (ptr == NULL) {
+        return 0;
+    }
+    
+    if (et == NULL) {
+        return -1;
+    }
+    
+    if (et->nb_retired == et->max_retired) {
+        
+        size_t max = et->max_retired == 0 ? MEMORY_EPOCH_BATCH : et->max_retired*2;
+        void** retired = (void**) realloc(et->retired, max*sizeof(void*));
+        if (retired == NULL) {
+            return -1;
+        }
+        et->retired = retired;
+        
+        unsigned long* retired_epoch = (unsigned long*) realloc(et->retired_epoch, max*sizeof(unsigned long));
+        if (retired_epoch == NULL) {
+            return -1;
+        }
+        et->retired_epoch = retired_epoch;
+        et->max_retired = max;
+    }
+    
+    et->retired[et->nb_retired] = ptr;
+    et->retired_epoch[et->nb_retired] = __atomic_load_n(&memory_epoch, __ATOMIC_SEQ_CST);
+    et->nb_retired++;
+    
+    // Tentative de récupération à chaque lot de retraits, même si la
+    // précédente a laissé des blocs en attente
+    if (++et->since_reclaim >= MEMORY_EPOCH_BATCH) {
+        Mem_EpochReclaim();
+    }
+    
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <pthread.h>
 #include <signal.h>
@@ -7,6 +8,7 @@
 #include <string.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <limits.h>
 
@@ -27,6 +29,46 @@ typedef int bool;
 
 #define NUM_BLOCK_SIZES	8000
 
+/* Heap size and time slice (in bytes moved) of the compaction benchmark.  */
+#define COMPACT_HEAP_SIZE	(16*1024*1024)
+#define COMPACT_SLICE		4096
+
+/* Heap size and single huge block of the large heap benchmark.  */
+#define LARGE_HEAP_SIZE		(6UL*1024*1024*1024)
+#define LARGE_BLOCK_SIZE	(3UL*1024*1024*1024)
+
+/* Heap size, number of timed searches and overrun length of the metadata
+   benchmark.  */
+#define SEARCH_HEAP_SIZE	(64*1024*1024)
+#define SEARCH_ROUNDS		100
+#define OVERRUN_SIZE		16
+
+/* Blocks freed after the huge one to make room for the searches of the large
+   heap benchmark (SEARCH_ROUNDS blocks of 4 * MAX_ALLOCATION_SIZE bytes).  */
+#define SEARCH_RUN		(SEARCH_ROUNDS * 16)
+
+/* Number of learned size classes and header size added to the power of two
+   requests of the size classes benchmark.  */
+#define NUM_CLASSES		8
+#define REQUEST_HEADER		24
+
+/* Filler block size, number of interleaved lists and traversal rounds of the
+   locality benchmark.  */
+#define NEAR_FILLER_SIZE	200
+#define NEAR_LISTS		64
+#define NEAR_ROUNDS		20
+
+/* Number of rounds, and of snapshots written, of the snapshot benchmark.  */
+#define SNAPSHOT_ROUNDS		4
+
+/* Heap file, heap size and handle size of the persistence benchmark, and
+   the environment variables carrying its stage and build time across exec.  */
+#define PERSIST_FILE		"testBeMa.heap"
+#define PERSIST_HEAP_SIZE	(64*1024*1024)
+#define PERSIST_HANDLE_SIZE	4096
+#define PERSIST_STAGE		"BEMA_PERSIST_STAGE"
+#define PERSIST_BUILD		"BEMA_PERSIST_BUILD"
+
 static volatile bool timeout;
 
 static unsigned int random_block_sizes[NUM_BLOCK_SIZES];
@@ -194,7 +236,7 @@ static void mem_bench(size_t num_blocks, int test_alloc, unsigned int test_order
     struct sigaction act;
     double total_i,total_s,total_err;
 
-    srand(time(NULL));
+    srand(RAND_SEED);
 
     TIMING_INIT (res);
 
@@ -226,9 +268,718 @@ static void mem_bench(size_t num_blocks, int test_alloc, unsigned int test_order
 }
 
 
+/* Fragment the heap with movable blocks mixing the uniform and power of two
+   sizes, free one block out of two (pinning a few survivors at the bottom), then compact
+   in bounded slices and report the footprint recovered */
+static void compact_bench(size_t num_blocks)
+{
+    timing_t start, stop, elapsed, total = 0, max_slice = 0;
+    size_t nb_empty, max_empty, footprint;
+    unsigned int slices = 0, errors = 0;
+    unsigned int *handles;
+    unsigned int *sizes;
+    unsigned int i;
+    int done = 0;
+
+    srand(RAND_SEED);
+    Mem_Init(COMPACT_HEAP_SIZE, NULL);
+
+    handles = malloc(num_blocks * sizeof (unsigned int));
+    sizes = malloc(num_blocks * sizeof (unsigned int));
+
+    for (i = 0; i < num_blocks; i++)
+    {
+        if (i % 2)
+            sizes[i] = get_block_size_uniform(MIN_ALLOCATION_SIZE, MAX_ALLOCATION_SIZE);
+        else
+            sizes[i] = get_block_size_power2(i % 12);
+        handles[i] = Mem_AllocHandle(sizes[i]);
+        if (handles[i] == 0)
+            errors++;
+        else
+            memset(Mem_Deref(handles[i]), i & 0xff, sizes[i]);
+    }
+    for (i = 0; i < num_blocks; i += 2)
+        if (handles[i] != 0)
+        {
+            Mem_FreeHandle(handles[i]);
+            handles[i] = 0;
+        }
+    for (i = 1; i < num_blocks / 4; i += 16)
+        if (handles[i] != 0)
+            Mem_Lock(handles[i]);
+
+    Mem_Stats(&nb_empty, &max_empty, &footprint);
+    printf("before: footprint %zu bytes, nb_empty %zu, max_empty %zu\n", footprint, nb_empty, max_empty);
+
+    while (!done)
+    {
+        TIMING_NOW (start);
+        done = Mem_Compact(COMPACT_SLICE);
+        TIMING_NOW (stop);
+        TIMING_DIFF (elapsed, start, stop);
+        TIMING_ACCUM (total, elapsed);
+        if (elapsed > max_slice)
+            max_slice = elapsed;
+        slices++;
+    }
+
+    /* Every surviving block must have kept its content */
+    for (i = 1; i < num_blocks; i += 2)
+    {
+        unsigned char *p = Mem_Deref(handles[i]);
+        unsigned int k;
+        if (p == NULL)
+            continue;
+        for (k = 0; k < sizes[i]; k++)
+            if (p[k] != (i & 0xff))
+            {
+                errors++;
+                break;
+            }
+    }
+
+    size_t before = footprint;
+    Mem_Stats(&nb_empty, &max_empty, &footprint);
+    printf("after: footprint %zu bytes, nb_empty %zu, max_empty %zu\n", footprint, nb_empty, max_empty);
+    printf("recovered %zu bytes\n", before - footprint);
+    printf("slices %u, max slice %.3f nano seconds, mean slice %.3f nano seconds\n",
+           slices, (double) max_slice, (double) total / slices);
+    printf("errors %u\n", errors);
+
+    free(handles);
+    free(sizes);
+}
+
+/* Allocate a block above 2 GiB in a heap above 4 GiB, then num_blocks small
+   blocks (the search path). Fill the trailing hole and free a run of blocks
+   right after the huge one, so that each timed search from the end of the
+   chain walks past all the other live blocks, far above 4 GiB, before
+   finding room. Then free one block out of two and then the others so every
+   free of the second pass coalesces with both neighbours */
+static void large_bench(size_t num_blocks)
+{
+    timing_t start, stop, elapsed;
+    size_t nb_empty, max_empty, footprint;
+    size_t i, run, errors = 0;
+    void *big[SEARCH_ROUNDS];
+    void **ptrs;
+    void *huge, *tail;
+
+    srand(RAND_SEED);
+    if (Mem_Init(LARGE_HEAP_SIZE, NULL) < 0)
+    {
+        printf("errors 1\n");
+        return;
+    }
+
+    huge = Mem_Alloc(LARGE_BLOCK_SIZE);
+    printf("block of %lu bytes %s\n", LARGE_BLOCK_SIZE, huge != NULL ? "allocated" : "failed");
+    if (huge == NULL)
+        errors++;
+
+    ptrs = malloc(num_blocks * sizeof (void *));
+
+    TIMING_NOW (start);
+    for (i = 0; i < num_blocks; i++)
+    {
+        ptrs[i] = Mem_Alloc(get_block_size_uniform(MIN_ALLOCATION_SIZE, MAX_ALLOCATION_SIZE));
+        if (ptrs[i] == NULL)
+            errors++;
+    }
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    printf("alloc: %.3f nano seconds per block\n", (double) elapsed / num_blocks);
+
+    /* The filler is never freed: zeroing it back would touch 3 GiB */
+    Mem_Stats(&nb_empty, &max_empty, &footprint);
+    tail = Mem_Alloc(max_empty - MIN_ALLOCATION_SIZE);
+    if (tail == NULL)
+        errors++;
+
+    run = num_blocks < SEARCH_RUN ? num_blocks : SEARCH_RUN;
+    for (i = 0; i < run; i++)
+    {
+        Mem_Free(ptrs[i]);
+        ptrs[i] = NULL;
+    }
+
+    TIMING_NOW (start);
+    for (i = 0; i < SEARCH_ROUNDS; i++)
+        big[i] = Mem_Alloc(MAX_ALLOCATION_SIZE * 4);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    for (i = 0; i < SEARCH_ROUNDS; i++)
+        if (big[i] == NULL)
+            errors++;
+        else
+            Mem_Free(big[i]);
+    printf("search past %lu blocks: %.3f nano seconds per allocation\n",
+           num_blocks - run, (double) elapsed / SEARCH_ROUNDS);
+
+    TIMING_NOW (start);
+    for (i = 0; i < num_blocks; i += 2)
+        if (ptrs[i] != NULL)
+            Mem_Free(ptrs[i]);
+    for (i = 1; i < num_blocks; i += 2)
+        if (ptrs[i] != NULL)
+            Mem_Free(ptrs[i]);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    if (num_blocks > run)
+        printf("free: %.3f nano seconds per block\n", (double) elapsed / (num_blocks - run));
+
+    Mem_Stats(&nb_empty, &max_empty, &footprint);
+    printf("nb_empty %zu, max_empty %zu, footprint %zu bytes\n", nb_empty, max_empty, footprint);
+    printf("errors %zu\n", errors);
+
+    free(ptrs);
+}
+
+/* Compare inline headers and the out-of-band metadata table: time the
+   allocation of num_blocks blocks and the freeing of every other one (in
+   table mode each split or merge shifts the tail of the table), leave
+   num_blocks/2 small holes, time allocations too large for any of them (each
+   one scans every block), then overrun every surviving block by a few bytes
+   and check whether the allocator metadata survived */
+static void search_bench(size_t num_blocks, int table)
+{
+    timing_t start, stop, elapsed;
+    size_t i, errors = 0;
+    void *big[SEARCH_ROUNDS];
+    unsigned int *sizes;
+    void **ptrs;
+    int check;
+
+    srand(RAND_SEED);
+    if ((table ? Mem_InitTable(SEARCH_HEAP_SIZE) : Mem_Init(SEARCH_HEAP_SIZE, NULL)) < 0)
+    {
+        printf("errors 1\n");
+        return;
+    }
+
+    ptrs = malloc(num_blocks * sizeof (void *));
+    sizes = malloc(num_blocks * sizeof (unsigned int));
+    for (i = 0; i < num_blocks; i++)
+        sizes[i] = get_block_size_uniform(MIN_ALLOCATION_SIZE, MAX_ALLOCATION_SIZE);
+
+    TIMING_NOW (start);
+    for (i = 0; i < num_blocks; i++)
+        ptrs[i] = Mem_Alloc(sizes[i]);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    for (i = 0; i < num_blocks; i++)
+        if (ptrs[i] == NULL)
+            errors++;
+    printf("alloc of %lu blocks: %.3f nano seconds per allocation\n",
+           num_blocks, (double) elapsed / num_blocks);
+
+    TIMING_NOW (start);
+    for (i = 0; i < num_blocks; i += 2)
+        Mem_Free(ptrs[i]);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    printf("free of every other block: %.3f nano seconds per free\n",
+           (double) elapsed / ((num_blocks + 1) / 2));
+
+    TIMING_NOW (start);
+    for (i = 0; i < SEARCH_ROUNDS; i++)
+        big[i] = Mem_Alloc(MAX_ALLOCATION_SIZE * 4);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    for (i = 0; i < SEARCH_ROUNDS; i++)
+        if (big[i] == NULL)
+            errors++;
+        else
+            Mem_Free(big[i]);
+    printf("search over %lu blocks: %.3f nano seconds per allocation\n",
+           num_blocks, (double) elapsed / SEARCH_ROUNDS);
+
+    /* Buffer overrun from every surviving block into the following hole */
+    for (i = 1; i + 1 < num_blocks; i += 2)
+        if (ptrs[i] != NULL)
+            memset((char *) ptrs[i] + sizes[i], 0xff, OVERRUN_SIZE);
+    check = Mem_Check();
+    printf("metadata after overrun: %s\n", check == 0 ? "intact" : "corrupted");
+
+    /* Freeing is only safe if the block list survived; every free now
+       merges the block with the holes on both sides */
+    if (check == 0)
+    {
+        TIMING_NOW (start);
+        for (i = 1; i < num_blocks; i += 2)
+            if (ptrs[i] != NULL && Mem_Free(ptrs[i]) != 0)
+                errors++;
+        TIMING_NOW (stop);
+        TIMING_DIFF (elapsed, start, stop);
+        printf("free with merges: %.3f nano seconds per free\n",
+               (double) elapsed / (num_blocks / 2));
+    }
+    printf("errors %lu\n", errors);
+
+    free(ptrs);
+    free(sizes);
+}
+
+/* Allocate and free num_blocks blocks mixing uniform sizes and powers of two
+   plus a small header, report the bytes lost to rounding */
+static size_t classes_waste(size_t num_blocks, size_t *requested)
+{
+    size_t i, waste = 0;
+
+    srand(RAND_SEED);
+    *requested = 0;
+    for (i = 0; i < num_blocks; i++)
+    {
+        size_t size = i % 2 ? get_block_size_uniform(MIN_ALLOCATION_SIZE, MAX_ALLOCATION_SIZE)
+                            : get_block_size_power2(i % 11) + REQUEST_HEADER;
+        void *ptr = Mem_Alloc(size);
+        if (ptr == NULL)
+            continue;
+        *requested += size;
+        waste += Mem_GetSize(ptr) - size;
+        Mem_Free(ptr);
+    }
+    return waste;
+}
+
+/* Internal fragmentation without classes, with power of two classes and with
+   classes learned from the same workload, then export the learned table */
+static void classes_bench(size_t num_blocks)
+{
+    static const size_t power2[] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+    size_t requested, waste;
+
+    Mem_Init(COMPACT_HEAP_SIZE, NULL);
+
+    waste = classes_waste(num_blocks, &requested);
+    printf("no classes: %zu bytes lost of %zu\n", waste, requested);
+
+    Mem_SetClasses(power2, sizeof (power2) / sizeof (power2[0]));
+    waste = classes_waste(num_blocks, &requested);
+    printf("power of two classes: %zu bytes lost of %zu\n", waste, requested);
+
+    Mem_TuneClasses(NUM_CLASSES);
+    waste = classes_waste(num_blocks, &requested);
+    printf("learned classes: %zu bytes lost of %zu\n", waste, requested);
+    fflush(stdout);
+    Mem_ExportClasses(1);
+}
+
+struct near_node
+{
+    struct near_node *next;
+    size_t value;
+    char payload[32];
+};
+
+/* Build NEAR_LISTS linked lists of num_blocks nodes in total, one node per
+   list in turn, each node allocated after its parent with Mem_Alloc or next
+   to it with Mem_AllocNear.  With Mem_AllocNear, the head of each list is
+   placed next to a filler of its own part of the heap */
+static size_t near_build(size_t num_blocks, void **fillers,
+                         struct near_node **heads, int near)
+{
+    struct near_node *tails[NEAR_LISTS] = { NULL };
+    size_t i, errors = 0;
+
+    for (i = 0; i < NEAR_LISTS; i++)
+        heads[i] = NULL;
+    for (i = 0; i < num_blocks; i++)
+    {
+        size_t l = i % NEAR_LISTS;
+        void *hint = tails[l] != NULL ? (void *) tails[l]
+                                      : fillers[(l * num_blocks / NEAR_LISTS) | 1];
+        struct near_node *node = near ? Mem_AllocNear(sizeof (*node), hint)
+                                      : Mem_Alloc(sizeof (*node));
+        if (node == NULL)
+        {
+            errors++;
+            continue;
+        }
+        node->next = NULL;
+        node->value = i;
+        if (tails[l] == NULL)
+            heads[l] = node;
+        else
+            tails[l]->next = node;
+        tails[l] = node;
+    }
+    return errors;
+}
+
+/* Follow every list NEAR_ROUNDS times, return the time per node */
+static double near_traverse(size_t num_blocks, struct near_node **heads)
+{
+    timing_t start, stop, elapsed;
+    volatile size_t sum = 0;
+    size_t round, l;
+
+    TIMING_NOW (start);
+    for (round = 0; round < NEAR_ROUNDS; round++)
+        for (l = 0; l < NEAR_LISTS; l++)
+            for (struct near_node *node = heads[l]; node != NULL; node = node->next)
+                sum += node->value;
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    return (double) elapsed / (NEAR_ROUNDS * num_blocks);
+}
+
+static void near_release(struct near_node **heads)
+{
+    for (size_t l = 0; l < NEAR_LISTS; l++)
+        for (struct near_node *node = heads[l], *next; node != NULL; node = next)
+        {
+            next = node->next;
+            Mem_Free(node);
+        }
+}
+
+/* Pointer chasing over lists built in a heap riddled with small holes:
+   first-fit placement puts consecutive nodes of a list NEAR_LISTS
+   allocations apart, Mem_AllocNear keeps each node close to its parent.
+   Freeing the first lists restores the same holes for the second run */
+static void near_bench(size_t num_blocks)
+{
+    struct near_node *heads[NEAR_LISTS];
+    size_t i, errors = 0;
+    void **fillers;
+    double ns;
+
+    if (Mem_Init(SEARCH_HEAP_SIZE, NULL) < 0)
+    {
+        printf("errors 1\n");
+        return;
+    }
+
+    fillers = malloc(num_blocks * sizeof (void *));
+    for (i = 0; i < num_blocks; i++)
+        fillers[i] = Mem_Alloc(NEAR_FILLER_SIZE);
+    for (i = 0; i < num_blocks; i += 2)
+        Mem_Free(fillers[i]);
+
+    errors += near_build(num_blocks, fillers, heads, 0);
+    ns = near_traverse(num_blocks, heads);
+    printf("traversal with Mem_Alloc: %.3f nano seconds per node\n", ns);
+    near_release(heads);
+
+    errors += near_build(num_blocks, fillers, heads, 1);
+    ns = near_traverse(num_blocks, heads);
+    printf("traversal with Mem_AllocNear: %.3f nano seconds per node\n", ns);
+    near_release(heads);
+
+    if (Mem_Check() != 0)
+        errors++;
+    printf("errors %lu\n", errors);
+
+    for (i = 1; i < num_blocks; i += 2)
+        Mem_Free(fillers[i]);
+    free(fillers);
+}
+
+/* Fragmenting workload: each of the SNAPSHOT_ROUNDS rounds allocates
+   num_blocks/SNAPSHOT_ROUNDS more blocks and frees a random half of the live
+   ones, then writes a snapshot to testBeMa-<round>.snap for analyzeBeMa.  The
+   heap lock is only held while Mem_Snapshot copies the block list, so the
+   time of each call bounds the pause seen by the other threads */
+static void snapshot_bench(size_t num_blocks)
+{
+    timing_t start, stop, elapsed;
+    size_t nb_empty, max_empty, footprint;
+    size_t i, n = 0, live = 0, errors = 0;
+    unsigned int round;
+    char name[32];
+    void **ptrs;
+    int fd;
+
+    srand(RAND_SEED);
+    if (Mem_Init(SEARCH_HEAP_SIZE, NULL) < 0)
+    {
+        printf("errors 1\n");
+        return;
+    }
+
+    ptrs = calloc(num_blocks, sizeof (void *));
+    for (round = 0; round < SNAPSHOT_ROUNDS; round++)
+    {
+        for (; n < num_blocks * (round + 1) / SNAPSHOT_ROUNDS; n++)
+        {
+            ptrs[n] = Mem_Alloc(get_block_size_uniform(MIN_ALLOCATION_SIZE, MAX_ALLOCATION_SIZE));
+            if (ptrs[n] == NULL)
+                errors++;
+            else
+                live++;
+        }
+        for (i = 0; i < n; i++)
+            if (ptrs[i] != NULL && rand() % 2)
+            {
+                Mem_Free(ptrs[i]);
+                ptrs[i] = NULL;
+                live--;
+            }
+
+        snprintf(name, sizeof (name), "testBeMa-%u.snap", round);
+        fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            perror(name);
+            errors++;
+            continue;
+        }
+        TIMING_NOW (start);
+        if (Mem_Snapshot(fd) != 0)
+            errors++;
+        TIMING_NOW (stop);
+        TIMING_DIFF (elapsed, start, stop);
+        close(fd);
+
+        Mem_Stats(&nb_empty, &max_empty, &footprint);
+        printf("%s: %lu live blocks, %zu holes, Mem_Snapshot %.3f micro seconds\n",
+               name, live, nb_empty, (double) elapsed / 1000);
+    }
+
+    for (i = 0; i < n; i++)
+        if (ptrs[i] != NULL)
+            Mem_Free(ptrs[i]);
+    free(ptrs);
+    printf("errors %lu\n", errors);
+}
+
+/* Nodes of the persistent list: the links are offsets from the root block,
+   so the list stays valid wherever the file is mapped (0 ends the list) */
+struct persist_node
+{
+    ptrdiff_t next;
+    size_t value;
+};
+
+struct persist_root
+{
+    ptrdiff_t first;
+    size_t nb;
+    unsigned int handle;
+};
+
+#define PERSIST_AT(root, off)	((struct persist_node *) ((char *) (root) + (off)))
+
+/* Start the benchmark over at the given stage in a new process */
+static void persist_exec(char **argv, const char *stage)
+{
+    setenv(PERSIST_STAGE, stage, 1);
+    fflush(stdout);
+    execv("/proc/self/exe", argv);
+    perror("execv");
+    exit(1);
+}
+
+/* Open the heap file in a fresh process, return 1 if Mem_Init rejected it */
+static int persist_rejected(char **argv)
+{
+    int status, null;
+    pid_t pid;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid == 0)
+    {
+        null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, 1);
+        persist_exec(argv, "open");
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0)
+        return 0;
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/* Build a list of num_blocks nodes and a movable block under the root of a
+   new heap file, leave one more block pending in maintenance mode 1, sync it
+   and go on with the reopen stage in a new process */
+static void persist_build(size_t num_blocks, char **argv)
+{
+    timing_t start, stop, elapsed;
+    struct persist_root *root;
+    struct persist_node *node;
+    ptrdiff_t prev = 0;
+    char build[32];
+    char *data;
+    void *spare;
+    size_t i;
+
+    unlink(PERSIST_FILE);
+    TIMING_NOW (start);
+    if (Mem_Init(PERSIST_HEAP_SIZE, PERSIST_FILE) != 0
+        || (root = Mem_Alloc(sizeof (*root))) == NULL)
+    {
+        printf("errors 1\n");
+        unlink(PERSIST_FILE);
+        return;
+    }
+    root->first = 0;
+    root->nb = 0;
+    for (i = 0; i < num_blocks; i++)
+    {
+        node = Mem_Alloc(sizeof (*node));
+        if (node == NULL)
+            break;
+        node->next = 0;
+        node->value = i;
+        if (prev == 0)
+            root->first = (char *) node - (char *) root;
+        else
+            PERSIST_AT(root, prev)->next = (char *) node - (char *) root;
+        prev = (char *) node - (char *) root;
+        root->nb++;
+    }
+    root->handle = Mem_AllocHandle(PERSIST_HANDLE_SIZE);
+    data = Mem_Lock(root->handle);
+    if (data != NULL)
+    {
+        memset(data, 0x5a, PERSIST_HANDLE_SIZE);
+        Mem_Unlock(root->handle);
+    }
+    Mem_SetRoot(root);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+
+    /* Mem_Init must release this block when the file is reopened */
+    spare = Mem_Alloc(PERSIST_HANDLE_SIZE);
+    Mem_SetMaintenance(1);
+    Mem_Free(spare);
+
+    if (Mem_Sync() != 0)
+    {
+        printf("errors 1\n");
+        unlink(PERSIST_FILE);
+        return;
+    }
+    printf("built %lu nodes and a handle of %d bytes under the root\n",
+           root->nb, PERSIST_HANDLE_SIZE);
+    snprintf(build, sizeof (build), "%llu", (unsigned long long) elapsed);
+    setenv(PERSIST_BUILD, build, 1);
+    persist_exec(argv, "reopen");
+}
+
+/* Reopen the heap file built by the previous process, time it against the
+   build, check the root, the list, the handle and the block chain and that
+   no block was left pending, then check that a bad magic and an overrun into
+   a block header are rejected at open.  The file is restored after each
+   corruption and removed at the end */
+static void persist_reopen(size_t num_blocks, char **argv)
+{
+    timing_t start, stop, elapsed;
+    struct persist_root *root;
+    struct persist_node *node;
+    unsigned int magic, bad;
+    char saved[OVERRUN_SIZE];
+    size_t i, errors = 0;
+    const char *build;
+    ptrdiff_t off;
+    char *data;
+    int fd, res;
+
+    TIMING_NOW (start);
+    res = Mem_Init(PERSIST_HEAP_SIZE, PERSIST_FILE);
+    TIMING_NOW (stop);
+    TIMING_DIFF (elapsed, start, stop);
+    build = getenv(PERSIST_BUILD);
+    if (res != 1 || build == NULL)
+    {
+        printf("reopen failed\nerrors 1\n");
+        unlink(PERSIST_FILE);
+        return;
+    }
+    printf("reopen: %.3f micro seconds, build: %.3f micro seconds\n",
+           (double) elapsed / 1000, strtod(build, NULL) / 1000);
+
+    if (Mem_Check() != 0)
+        errors++;
+    root = Mem_GetRoot();
+    if (root == NULL || root->nb != num_blocks)
+        errors++;
+    else
+    {
+        for (i = 0, off = root->first; off != 0 && i < root->nb; i++, off = node->next)
+        {
+            node = PERSIST_AT(root, off);
+            if (node->value != i)
+                errors++;
+        }
+        if (i != root->nb || off != 0)
+            errors++;
+        data = Mem_Lock(root->handle);
+        if (data == NULL)
+            errors++;
+        else
+        {
+            for (i = 0; i < PERSIST_HANDLE_SIZE; i++)
+                if (data[i] != 0x5a)
+                    errors++;
+            Mem_Unlock(root->handle);
+        }
+    }
+    printf("root, list and handle after reopen: %s\n", errors == 0 ? "intact" : "lost");
+
+    res = Mem_Maintain();
+    printf("blocks still pending after reopen: %d\n", res);
+    if (res != 0)
+        errors++;
+
+    fd = open(PERSIST_FILE, O_RDWR);
+    if (fd < 0 || pread(fd, &magic, sizeof (magic), 0) != sizeof (magic))
+        errors++;
+    else
+    {
+        bad = ~magic;
+        if (pwrite(fd, &bad, sizeof (bad), 0) != sizeof (bad))
+            errors++;
+        res = persist_rejected(argv);
+        if (pwrite(fd, &magic, sizeof (magic), 0) != sizeof (magic))
+            errors++;
+        printf("bad magic: %s\n", res ? "rejected" : "accepted");
+        if (!res)
+            errors++;
+    }
+    if (fd >= 0)
+        close(fd);
+
+    /* The file is mapped shared: the overrun goes straight to the file */
+    if (root != NULL && root->first != 0)
+    {
+        node = PERSIST_AT(root, root->first);
+        data = (char *) node + Mem_GetSize(node);
+        memcpy(saved, data, OVERRUN_SIZE);
+        memset(data, 0xff, OVERRUN_SIZE);
+        res = persist_rejected(argv);
+        memcpy(data, saved, OVERRUN_SIZE);
+        printf("overrun into a block header: %s\n", res ? "rejected" : "accepted");
+        if (!res)
+            errors++;
+    }
+
+    if (Mem_Check() != 0)
+        errors++;
+    printf("errors %lu\n", errors);
+    unlink(PERSIST_FILE);
+}
+
+/* Warm restart: the first process builds the heap file, the exec'd one
+   reopens and checks it, and short-lived children only try to open it */
+static void persist_bench(size_t num_blocks, char **argv)
+{
+    const char *stage = getenv(PERSIST_STAGE);
+
+    if (stage == NULL)
+        persist_build(num_blocks, argv);
+    else if (strcmp(stage, "open") == 0)
+        exit(Mem_Init(PERSIST_HEAP_SIZE, PERSIST_FILE) < 0 ? 0 : 1);
+    else
+        persist_reopen(num_blocks, argv);
+}
+
 static void usage(const char *name)
 {
-    fprintf (stderr, "%s: <num_blocks> [<test allocation:0,1,2> <test order:0,1> <test free:0,1>]\n", name);
+    fprintf (stderr, "%s: <num_blocks> [<test allocation:0,1,2> <test order:0,1> <test free:0,1> | compact | large | headers | table | classes | near | persist | snapshot]\n", name);
     exit (1);
 }
 /*
@@ -239,6 +990,21 @@ allocation type, order and free as described in the project document.
 For example: testmem 10 0 0 0 will execute the program to allocate 10 small blocks,
 then free all of them and the free function uses the exact pointer returned
 by the allocation function.
+With "compact" as second argument (testmem 10000 compact) it runs the
+compaction benchmark on movable blocks instead, and with "large" the large
+heap benchmark (testmem 10000000 large). "headers" and "table" run the free
+block search and buffer overrun benchmark with inline headers or with the
+out-of-band metadata table. "classes" compares the internal fragmentation of
+no size classes, power of two classes and classes learned from the workload,
+then prints the learned table for make CLASSES=<file>. "near" times the
+traversal of linked lists built with Mem_Alloc and with Mem_AllocNear; the
+heap must be larger than the caches to see a difference (testmem 100000 near).
+"persist" builds a list and a handle under the root of a heap file
+(testBeMa.heap in the current directory), re-executes itself to reopen and
+check it, times the reopen against the build and checks that corrupted files
+are rejected. "snapshot" writes testBeMa-0.snap to testBeMa-3.snap in the
+current directory during a fragmenting workload and times each Mem_Snapshot;
+read them with analyzeBeMa testBeMa-*.snap.
 */
 
 int
@@ -249,6 +1015,13 @@ main (int argc, char **argv)
     unsigned int test_alloc, test_order, test_free;
     size_t num_blocks;
     bool mode_single=false;
+    bool mode_compact=false;
+    bool mode_large=false;
+    bool mode_classes=false;
+    bool mode_near=false;
+    bool mode_persist=false;
+    bool mode_snapshot=false;
+    const char *mode_search=NULL;
 
     if (argc == 1)
         num_blocks = 1;
@@ -261,6 +1034,31 @@ main (int argc, char **argv)
             usage(argv[0]);
         num_blocks = ret;
     }
+    else if (argc == 3)
+    {
+        long ret;
+        errno = 0;
+        ret = strtol(argv[1], NULL, 10);
+        if (errno || ret == 0)
+            usage(argv[0]);
+        num_blocks = ret;
+        if (strcmp(argv[2], "compact") == 0)
+            mode_compact = true;
+        else if (strcmp(argv[2], "large") == 0)
+            mode_large = true;
+        else if (strcmp(argv[2], "classes") == 0)
+            mode_classes = true;
+        else if (strcmp(argv[2], "near") == 0)
+            mode_near = true;
+        else if (strcmp(argv[2], "persist") == 0)
+            mode_persist = true;
+        else if (strcmp(argv[2], "snapshot") == 0)
+            mode_snapshot = true;
+        else if (strcmp(argv[2], "headers") == 0 || strcmp(argv[2], "table") == 0)
+            mode_search = argv[2];
+        else
+            usage(argv[0]);
+    }
     else if (argc == 5)
     {
         long ret;
@@ -299,8 +1097,43 @@ main (int argc, char **argv)
     getrusage(RUSAGE_SELF, &usage);
     printf("Number of blocks %lu\n", num_blocks);
     printf("process memory usage %lu Kb\n",usage.ru_maxrss);
+    if (mode_compact == true)
+    {
+        printf("-------------------- Test compaction ------------------------\n");
+        compact_bench(num_blocks);
+    }
+    else if (mode_classes == true)
+    {
+        printf("-------------------- Test size classes ------------------------\n");
+        classes_bench(num_blocks);
+    }
+    else if (mode_near == true)
+    {
+        printf("-------------------- Test locality ------------------------\n");
+        near_bench(num_blocks);
+    }
+    else if (mode_snapshot == true)
+    {
+        printf("-------------------- Test snapshots ------------------------\n");
+        snapshot_bench(num_blocks);
+    }
+    else if (mode_persist == true)
+    {
+        printf("-------------------- Test persistence ------------------------\n");
+        persist_bench(num_blocks, argv);
+    }
+    else if (mode_search != NULL)
+    {
+        printf("-------------------- Test search (%s) ------------------------\n", mode_search);
+        search_bench(num_blocks, strcmp(mode_search, "table") == 0);
+    }
+    else if (mode_large == true)
+    {
+        printf("-------------------- Test large heap ------------------------\n");
+        large_bench(num_blocks);
+    }
     /* Make a single test with the values provides as arguments */
-    if (mode_single == true)
+    else if (mode_single == true)
     {
         printf("-------------------- Test [%d,%d,%d] ------------------------\n",test_alloc,test_order,test_free);
         mem_bench(num_blocks, test_alloc,test_order,test_free);
@@ -0,0 +1,142 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory_resource>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+#include "bema.hpp"
+
+/* Container benchmark: the same workloads with std::allocator, the
+   stateless BeMaAllocator, a pmr container over the BeMa heap and a pmr
+   container over a monotonic resource fed by the BeMa heap.  */
+
+#define RAND_SEED		88
+
+/* Heap reserved for libBeMa.  */
+#define CPP_HEAP_SIZE		(256*1024*1024)
+
+/* Default number of elements per workload.  */
+#define DEFAULT_ELEMENTS	1000
+
+template <class T>
+using bema_vector = std::vector<T, bema::BeMaAllocator<T> >;
+
+template <class K, class V>
+using bema_map = std::map<K, V, std::less<K>, bema::BeMaAllocator<std::pair<const K, V> > >;
+
+template <class K, class V>
+using bema_unordered_map = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>,
+                                              bema::BeMaAllocator<std::pair<const K, V> > >;
+
+/* Run a workload and print its mean time per element */
+static void run(const char *workload, const char *alloc, size_t n,
+                const std::function<void (void)> &f)
+{
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto stop = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(stop - start).count();
+    printf("%-14s %-10s %12.3f nano seconds per element\n", workload, alloc, ns / n);
+}
+
+/* Grow a vector one element at a time */
+template <class Vector>
+static void vector_push(Vector &v, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        v.push_back((int) i);
+}
+
+/* Insert random keys, erase half of them and look the others up */
+template <class Map>
+static void map_churn(Map &m, size_t n)
+{
+    std::mt19937 gen(RAND_SEED);
+    std::vector<int> keys(n);
+    for (size_t i = 0; i < n; i++)
+    {
+        keys[i] = (int) gen();
+        m[keys[i]] = (int) i;
+    }
+    for (size_t i = 0; i < n; i += 2)
+        m.erase(keys[i]);
+    for (size_t i = 1; i < n; i += 2)
+        if (m.find(keys[i]) == m.end())
+            abort();
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "%s: [<num_elements>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = DEFAULT_ELEMENTS;
+
+    if (argc > 2)
+        usage(argv[0]);
+    if (argc == 2)
+    {
+        long ret = strtol(argv[1], NULL, 10);
+        if (ret <= 0)
+            usage(argv[0]);
+        n = ret;
+    }
+
+    Mem_Init(CPP_HEAP_SIZE, NULL);
+
+    printf("----------- Start benchmarking C++ containers ----------------------\n");
+    printf("Number of elements %lu\n", n);
+
+    run("vector", "std", n, [n] { std::vector<int> v; vector_push(v, n); });
+    run("vector", "bema", n, [n] { bema_vector<int> v; vector_push(v, n); });
+    run("vector", "pmr", n, [n] {
+        std::pmr::vector<int> v(bema::bema_resource());
+        vector_push(v, n);
+    });
+    run("vector", "monotonic", n, [n] {
+        bema::BeMaMonotonicResource pool;
+        std::pmr::vector<int> v(&pool);
+        vector_push(v, n);
+    });
+
+    run("map", "std", n, [n] { std::map<int, int> m; map_churn(m, n); });
+    run("map", "bema", n, [n] { bema_map<int, int> m; map_churn(m, n); });
+    run("map", "pmr", n, [n] {
+        std::pmr::map<int, int> m(bema::bema_resource());
+        map_churn(m, n);
+    });
+    run("map", "monotonic", n, [n] {
+        bema::BeMaMonotonicResource pool;
+        std::pmr::map<int, int> m(&pool);
+        map_churn(m, n);
+    });
+
+    run("unordered_map", "std", n, [n] { std::unordered_map<int, int> m; map_churn(m, n); });
+    run("unordered_map", "bema", n, [n] { bema_unordered_map<int, int> m; map_churn(m, n); });
+    run("unordered_map", "pmr", n, [n] {
+        std::pmr::unordered_map<int, int> m(bema::bema_resource());
+        map_churn(m, n);
+    });
+    run("unordered_map", "monotonic", n, [n] {
+        bema::BeMaMonotonicResource pool;
+        std::pmr::unordered_map<int, int> m(&pool);
+        map_churn(m, n);
+    });
+
+    /* allocate(0, 1) is a valid memory_resource call */
+    void *empty = bema::bema_resource()->allocate(0, 1);
+    bema::bema_resource()->deallocate(empty, 0, 1);
+    printf("zero-size allocation: freed\n");
+
+    size_t nb_empty, max_empty, footprint;
+    Mem_Stats(&nb_empty, &max_empty, &footprint);
+    printf("heap after all workloads: nb_empty %zu, footprint %zu bytes\n", nb_empty, footprint);
+    return 0;
+}
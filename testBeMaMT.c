@@ -0,0 +1,523 @@
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bema.h"
+
+/* Multithreaded scalability benchmark: runs the allocation distributions of
+   testBeMa from 1 to N threads against libBeMa and glibc malloc.  */
+
+#define RAND_SEED		88
+
+#define MIN_ALLOCATION_SIZE	8
+#define MAX_ALLOCATION_SIZE	256
+
+/* Heap reserved for libBeMa, shared by every run.  */
+#define MT_HEAP_SIZE		(256*1024*1024)
+
+/* Default number of operations done by each thread.  */
+#define DEFAULT_OPS		2000
+
+/* Blocks kept alive by each thread in the private churn test.  */
+#define PRIVATE_SLOTS		64
+
+/* Capacity of each producer/consumer ring.  */
+#define RING_SIZE		256
+
+/* Blocks in the working set shared by all threads.  */
+#define SHARED_SLOTS		1024
+
+/* Percentage of updates in the read-mostly test, the tag written in the
+   first byte of each new block (a freed BeMa block reads as 0) and the
+   period, in lookups, at which a reader yields the CPU while holding a
+   block.  */
+#define UPDATE_PERCENT		10
+#define READ_TAG		0x5a
+#define READ_YIELD		16
+
+#define MAX_THREADS		64
+
+typedef struct allocator
+{
+    const char *name;
+    void *(*alloc) (size_t);
+    void (*free) (void *);
+    int maintenance;
+    int epoch;
+    /* The blocks stay mapped once freed, so readers may look at them */
+    int mapped;
+} allocator;
+
+typedef struct ring
+{
+    void *slots[RING_SIZE];
+    unsigned int head;
+    unsigned int tail;
+} ring;
+
+typedef struct thread_arg
+{
+    unsigned int num;
+    unsigned int nb_threads;
+    unsigned int test_alloc;
+    unsigned int test_scenario;
+    unsigned int ops;
+    unsigned int seed;
+    uint64_t *latencies;
+    unsigned int nb_latencies;
+    uint64_t start;
+    uint64_t stop;
+    unsigned long stale;
+} thread_arg;
+
+static const allocator *cur_alloc;
+static ring rings[MAX_THREADS];
+static void *shared_slots[SHARED_SLOTS];
+static pthread_barrier_t start_barrier;
+
+static void *
+bema_alloc (size_t size)
+{
+    return Mem_Alloc(size);
+}
+
+static void
+bema_free (void *ptr)
+{
+    Mem_Free(ptr);
+}
+
+static void
+bema_free_deferred (void *ptr)
+{
+    Mem_FreeDeferred(ptr);
+}
+
+static const allocator allocators[] =
+{
+    { "bema", bema_alloc, bema_free, 0, 0, 1 },
+    { "bemabg", bema_alloc, bema_free, 2, 0, 1 },
+    { "bemaep", bema_alloc, bema_free_deferred, 0, 1, 1 },
+    { "malloc", malloc, free, -1, 0, 0 },
+};
+
+static const char *scenarios[] = { "private", "handoff", "shared", "readmost" };
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec tv;
+    clock_gettime (CLOCK_MONOTONIC, &tv);
+    return (uint64_t) tv.tv_nsec + (uint64_t) 1000000000 * tv.tv_sec;
+}
+
+/* Same distributions as testBeMa: uniform, alternate small/large and power
+   of two, computed from the operation index and a per-thread seed.  */
+static unsigned int
+get_block_size (unsigned int test, unsigned int index, unsigned int *seed)
+{
+    if (test == 0)
+        return MIN_ALLOCATION_SIZE
+            + rand_r (seed) % (MAX_ALLOCATION_SIZE - MIN_ALLOCATION_SIZE);
+    if (test == 1)
+        return index % 2 ? 64*1024 : 64;
+    return 1U << (index % 12);
+}
+
+/* Time a single allocation or free and record its latency */
+static void *
+timed_alloc (thread_arg *ta, size_t size)
+{
+    uint64_t start = now_ns ();
+    void *ptr = cur_alloc->alloc (size);
+    ta->latencies[ta->nb_latencies++] = now_ns () - start;
+    return ptr;
+}
+
+static void
+timed_free (thread_arg *ta, void *ptr)
+{
+    uint64_t start = now_ns ();
+    cur_alloc->free (ptr);
+    ta->latencies[ta->nb_latencies++] = now_ns () - start;
+}
+
+/* Each thread allocates and frees blocks of its own working set */
+static void
+private_churn (thread_arg *ta)
+{
+    void *slots[PRIVATE_SLOTS];
+    unsigned int i;
+
+    memset (slots, 0, sizeof (slots));
+    for (i = 0; i < ta->ops; i++)
+    {
+        unsigned int k = rand_r (&ta->seed) % PRIVATE_SLOTS;
+        if (slots[k] != NULL)
+        {
+            timed_free (ta, slots[k]);
+            slots[k] = NULL;
+        }
+        else
+            slots[k] = timed_alloc (ta, get_block_size (ta->test_alloc, i, &ta->seed));
+    }
+    for (i = 0; i < PRIVATE_SLOTS; i++)
+        if (slots[i] != NULL)
+            cur_alloc->free (slots[i]);
+}
+
+/* Each thread pushes its blocks to its own ring and frees the blocks
+   produced by the previous thread, so blocks are freed by another thread */
+static void
+handoff (thread_arg *ta)
+{
+    ring *out = &rings[ta->num];
+    ring *in = &rings[(ta->num + ta->nb_threads - 1) % ta->nb_threads];
+    unsigned int i;
+
+    for (i = 0; i < ta->ops; i++)
+    {
+        unsigned int tail = __atomic_load_n (&in->tail, __ATOMIC_ACQUIRE);
+        unsigned int head = __atomic_load_n (&out->head, __ATOMIC_ACQUIRE);
+
+        if (i % 2 && in->head != tail)
+        {
+            timed_free (ta, in->slots[in->head % RING_SIZE]);
+            __atomic_store_n (&in->head, in->head + 1, __ATOMIC_RELEASE);
+        }
+        else if (out->tail - head < RING_SIZE)
+        {
+            void *ptr = timed_alloc (ta, get_block_size (ta->test_alloc, i, &ta->seed));
+            if (ptr == NULL)
+                continue;
+            out->slots[out->tail % RING_SIZE] = ptr;
+            __atomic_store_n (&out->tail, out->tail + 1, __ATOMIC_RELEASE);
+        }
+    }
+}
+
+/* All threads replace random blocks of a common working set */
+static void
+shared_replace (thread_arg *ta)
+{
+    unsigned int i;
+
+    for (i = 0; i < ta->ops; i += 2)
+    {
+        unsigned int k = rand_r (&ta->seed) % SHARED_SLOTS;
+        void *ptr = timed_alloc (ta, get_block_size (ta->test_alloc, i, &ta->seed));
+        void *old = __atomic_exchange_n (&shared_slots[k], ptr, __ATOMIC_ACQ_REL);
+        if (old != NULL)
+            timed_free (ta, old);
+    }
+}
+
+/* Readers look up blocks of the common working set while a few updates
+   replace them.  With bemaep the readers run in epoch critical sections and
+   replaced blocks go through Mem_FreeDeferred; the other allocators free
+   them at once, so a reader may load a block that is freed under it.  The
+   BeMa heap is never unmapped and a freed block is zero-filled, so the
+   readers check the tag of each block they load and count the stale reads
+   (a lower bound: a freed block can be reused and tagged again).  glibc may
+   give freed memory back to the system, so with malloc the readers only
+   load the pointer.  Every READ_YIELD lookups the reader yields between the
+   load and the check, as if it were preempted there, so that the race also
+   shows up on a single CPU; the pause is left out of the latency */
+static void
+read_mostly (thread_arg *ta)
+{
+    unsigned int i = 0;
+
+    while (i < ta->ops)
+    {
+        unsigned int k = rand_r (&ta->seed) % SHARED_SLOTS;
+        if (rand_r (&ta->seed) % 100 < UPDATE_PERCENT && i + 2 <= ta->ops)
+        {
+            char *ptr = timed_alloc (ta, get_block_size (ta->test_alloc, i, &ta->seed));
+            if (ptr != NULL)
+                *ptr = READ_TAG;
+            void *old = __atomic_exchange_n (&shared_slots[k], ptr, __ATOMIC_ACQ_REL);
+            if (old != NULL)
+                timed_free (ta, old);
+            i += 2;
+        }
+        else
+        {
+            uint64_t start = now_ns (), paused = 0;
+            if (cur_alloc->epoch)
+                Mem_EpochEnter();
+            char *ptr = __atomic_load_n (&shared_slots[k], __ATOMIC_ACQUIRE);
+            if (i % READ_YIELD == 0)
+            {
+                uint64_t pause = now_ns ();
+                sched_yield ();
+                paused = now_ns () - pause;
+            }
+            if (ptr != NULL && cur_alloc->mapped
+                && *(volatile char *) ptr != READ_TAG)
+                ta->stale++;
+            if (cur_alloc->epoch)
+                Mem_EpochExit();
+            ta->latencies[ta->nb_latencies++] = now_ns () - start - paused;
+            i++;
+        }
+    }
+}
+
+static void *
+thread_main (void *arg)
+{
+    thread_arg *ta = arg;
+
+    pthread_barrier_wait (&start_barrier);
+    ta->start = now_ns ();
+    if (ta->test_scenario == 0)
+        private_churn (ta);
+    else if (ta->test_scenario == 1)
+        handoff (ta);
+    else if (ta->test_scenario == 2)
+        shared_replace (ta);
+    else
+        read_mostly (ta);
+    ta->stop = now_ns ();
+    return NULL;
+}
+
+static int
+compare_latency (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+/* Reset the peak resident set size of the process, so that the next
+   read_peak_rss only covers the current run (Linux >= 4.0) */
+static void
+reset_peak_rss (void)
+{
+    FILE *f = fopen ("/proc/self/clear_refs", "w");
+    if (f == NULL)
+        return;
+    fputs ("5", f);
+    fclose (f);
+}
+
+/* Peak resident set size in Kb since the last reset, falls back to the
+   process lifetime peak */
+static unsigned long
+read_peak_rss (void)
+{
+    char line[256];
+    unsigned long kb = 0;
+    FILE *f = fopen ("/proc/self/status", "r");
+    if (f != NULL)
+    {
+        while (fgets (line, sizeof (line), f) != NULL)
+            if (sscanf (line, "VmHWM: %lu", &kb) == 1)
+                break;
+        fclose (f);
+    }
+    if (kb == 0)
+    {
+        struct rusage usage;
+        getrusage (RUSAGE_SELF, &usage);
+        kb = usage.ru_maxrss;
+    }
+    return kb;
+}
+
+/* Run one configuration with nb_threads threads and print its results.
+   Returns the aggregate throughput in operations per second.  */
+static double
+mt_bench (unsigned int nb_threads, unsigned int test_alloc,
+          unsigned int test_scenario, unsigned int ops, double base)
+{
+    pthread_t threads[MAX_THREADS];
+    thread_arg args[MAX_THREADS];
+    uint64_t start, stop, *all;
+    unsigned int i, k, n = 0;
+    unsigned long stale = 0;
+    double total_s, rate;
+
+    reset_peak_rss ();
+    memset (rings, 0, sizeof (rings));
+    memset (shared_slots, 0, sizeof (shared_slots));
+    pthread_barrier_init (&start_barrier, NULL, nb_threads);
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        args[i].num = i;
+        args[i].nb_threads = nb_threads;
+        args[i].test_alloc = test_alloc;
+        args[i].test_scenario = test_scenario;
+        args[i].ops = ops;
+        args[i].seed = RAND_SEED + i;
+        args[i].latencies = malloc (ops * sizeof (uint64_t));
+        args[i].nb_latencies = 0;
+        args[i].stale = 0;
+        pthread_create (&threads[i], NULL, thread_main, &args[i]);
+    }
+
+    /* The run lasts from the first thread start to the last thread end */
+    start = UINT64_MAX;
+    stop = 0;
+    for (i = 0; i < nb_threads; i++)
+    {
+        pthread_join (threads[i], NULL);
+        if (args[i].start < start)
+            start = args[i].start;
+        if (args[i].stop > stop)
+            stop = args[i].stop;
+    }
+    pthread_barrier_destroy (&start_barrier);
+
+    /* Release what is left in the rings and in the shared working set */
+    for (i = 0; i < nb_threads; i++)
+        for (; rings[i].head != rings[i].tail; rings[i].head++)
+            cur_alloc->free (rings[i].slots[rings[i].head % RING_SIZE]);
+    for (i = 0; i < SHARED_SLOTS; i++)
+        if (shared_slots[i] != NULL)
+            cur_alloc->free (shared_slots[i]);
+
+    for (i = 0; i < nb_threads; i++)
+    {
+        n += args[i].nb_latencies;
+        stale += args[i].stale;
+    }
+    all = malloc ((n + 1) * sizeof (uint64_t));
+    n = 0;
+    for (i = 0; i < nb_threads; i++)
+        for (k = 0; k < args[i].nb_latencies; k++)
+            all[n++] = args[i].latencies[k];
+    qsort (all, n, sizeof (uint64_t), compare_latency);
+
+    total_s = (stop - start) / 1e9;
+    rate = n / total_s;
+    printf ("%-6s %-8s %u %2u %12.0f ops/s %8.1f%% p50 %8lu p90 %8lu p99 %8lu max %9lu ns peak_rss %lu Kb stale ",
+            cur_alloc->name, scenarios[test_scenario], test_alloc, nb_threads,
+            rate, base > 0 ? 100 * rate / (base * nb_threads) : 100.0,
+            (unsigned long) all[n / 2], (unsigned long) all[n * 9 / 10],
+            (unsigned long) all[n * 99 / 100], (unsigned long) (n ? all[n - 1] : 0),
+            read_peak_rss ());
+    if (cur_alloc->mapped)
+        printf ("%lu\n", stale);
+    else
+        printf ("-\n");
+    free (all);
+
+    /* The same percentiles for each thread, to spot an unfair allocator */
+    if (nb_threads > 1)
+    {
+        printf ("    per thread p50/p99 ns:");
+        for (i = 0; i < nb_threads; i++)
+        {
+            unsigned int m = args[i].nb_latencies;
+            qsort (args[i].latencies, m, sizeof (uint64_t), compare_latency);
+            printf (" %lu/%lu", m ? (unsigned long) args[i].latencies[m / 2] : 0,
+                    m ? (unsigned long) args[i].latencies[m * 99 / 100] : 0);
+        }
+        printf ("\n");
+    }
+    for (i = 0; i < nb_threads; i++)
+        free (args[i].latencies);
+    return rate;
+}
+
+static void usage(const char *name)
+{
+    fprintf (stderr, "%s: <max_threads> [<ops per thread> [bema|bemabg|bemaep|malloc]]\n", name);
+    exit (1);
+}
+
+/*
+Runs every scenario (private churn, producer/consumer handoff, shared working
+set, read-mostly lookups) with every allocation distribution (0 uniform, 1 alternate, 2 power of
+two) from 1 to max_threads threads. The efficiency column is the throughput
+relative to the number of threads times the single thread throughput. Every
+thread draws its sizes from a fixed seed so runs are reproducible. bemaep
+frees through the epoch-based Mem_FreeDeferred instead of Mem_Free. Each
+allocator runs in its own child process and the peak RSS is reset before
+every run, so the peak_rss column only covers that run and that allocator.
+The stale column counts the lookups of the read-mostly test that found a
+freed block (not measured with malloc).
+*/
+int
+main (int argc, char **argv)
+{
+    unsigned int max_threads, ops = DEFAULT_OPS;
+    unsigned int a, test_alloc, test_scenario, t;
+    const char *only = NULL;
+    long ret;
+
+    if (argc < 2 || argc > 4)
+        usage(argv[0]);
+    errno = 0;
+    ret = strtol(argv[1], NULL, 10);
+    if (errno || ret <= 0 || ret > MAX_THREADS)
+        usage(argv[0]);
+    max_threads = ret;
+    if (argc >= 3)
+    {
+        ret = strtol(argv[2], NULL, 10);
+        if (errno || ret <= 0)
+            usage(argv[0]);
+        ops = ret;
+    }
+    if (argc == 4)
+        only = argv[3];
+
+    printf("----------- Start multithreaded benchmark ----------------------\n");
+    printf("threads 1..%u, %u operations per thread\n", max_threads, ops);
+    for (a = 0; a < sizeof (allocators) / sizeof (allocators[0]); a++)
+    {
+        if (only != NULL && strcmp (only, allocators[a].name) != 0)
+            continue;
+        cur_alloc = &allocators[a];
+
+        /* A fresh process per allocator: the BeMa heap is only mapped by
+           the BeMa runs and no allocator inherits another one's pages */
+        fflush (stdout);
+        pid_t pid = fork ();
+        if (pid < 0)
+        {
+            perror ("fork");
+            return 1;
+        }
+        if (pid > 0)
+        {
+            waitpid (pid, NULL, 0);
+            continue;
+        }
+
+        /* bemabg defers coalescing and zeroing to the maintenance thread */
+        if (cur_alloc->maintenance >= 0)
+        {
+            Mem_Init(MT_HEAP_SIZE, NULL);
+            Mem_SetMaintenance(cur_alloc->maintenance);
+        }
+        for (test_scenario = 0; test_scenario <= 3; test_scenario++)
+            for (test_alloc = 0; test_alloc <= 2; test_alloc++)
+            {
+                double base = 0;
+                for (t = 1; t <= max_threads; t++)
+                {
+                    double rate = mt_bench (t, test_alloc, test_scenario, ops, base);
+                    if (t == 1)
+                        base = rate;
+                }
+            }
+        fflush (stdout);
+        _exit (0);
+    }
+    return 0;
+}